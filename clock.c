@@ -0,0 +1,84 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdint.h>
+#include "clock.h"
+
+// The device clock counts milliseconds since power on.
+// While the USB host is sending start of frame packets the clock advances
+// once per frame, so it is locked to the host controller's clock and
+// controllers attached to the same host tick together.
+// Timer0 runs at 4us per tick and is reset at every SOF to interpolate
+// within a frame. If a frame is missed (or USB is not connected) the timer
+// compare match takes over and advances the clock from the crystal.
+
+// Timer0 ticks per millisecond at F_CPU / 64
+#define TICKS_PER_MS 250
+
+// Compare value used while frames are arriving. This is slightly longer
+// than a frame so that it only fires if the next SOF doesn't arrive.
+#define SOF_TIMEOUT_TICKS 255
+
+static volatile uint32_t clock_ms;
+
+void clock_initialize(void)
+{
+    // CTC mode, F_CPU / 64
+    TCCR0A = _BV(WGM01);
+    TCCR0B = _BV(CS01) | _BV(CS00);
+    OCR0A = TICKS_PER_MS - 1;
+    TIMSK0 |= _BV(OCIE0A);
+}
+
+// Called from the USB start of frame event
+void clock_start_of_frame(void)
+{
+    TCNT0 = 0;
+    OCR0A = SOF_TIMEOUT_TICKS;
+    TIFR0 = _BV(OCF0A);
+    clock_ms++;
+}
+
+// Read the clock with sub-millisecond precision
+void clock_read(uint32_t *ms, uint16_t *us)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        uint32_t t = clock_ms;
+        uint8_t ticks = TCNT0;
+
+        if ((TIFR0 & _BV(OCF0A)) && ticks < TICKS_PER_MS / 2)
+        {
+            // A compare match has reset the timer but not yet been counted
+            t++;
+        }
+        else if (ticks >= TICKS_PER_MS)
+        {
+            // A frame has started but the SOF event has not yet run
+            t++;
+            ticks -= TICKS_PER_MS;
+        }
+
+        *ms = t;
+        *us = ticks * 4;
+    }
+}
+
+uint32_t clock_millis(void)
+{
+    uint32_t ms;
+    uint16_t us;
+    clock_read(&ms, &us);
+    return ms;
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+    // No SOF arrived in time: free-run from the crystal until they return
+    OCR0A = TICKS_PER_MS - 1;
+    clock_ms++;
+}
@@ -0,0 +1,15 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdint.h>
+
+#ifndef FOCUSER_CLOCK_H
+#define FOCUSER_CLOCK_H
+
+void clock_initialize(void);
+void clock_start_of_frame(void);
+uint32_t clock_millis(void);
+void clock_read(uint32_t *ms, uint16_t *us);
+
+#endif
@@ -0,0 +1,174 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <util/crc16.h>
+#include "compensation.h"
+#include "config.h"
+#include "journal.h"
+#include "stepper.h"
+#include "temperature.h"
+
+// Each channel can follow a linear temperature-to-focus model using one of the probes:
+// the offset from the focus at the reference temperature is coefficient * (T - reference).
+// Readings from the chosen probe are smoothed with an exponential filter, and whenever the
+// filtered temperature has moved by more than the deadband since the last correction the
+// change in offset is added to the channel target (and any scheduled move).
+// Host moves set the physical position at the current temperature, and are followed
+// by corrections from that point onwards. The offset that has been applied is saved
+// in the position journal, in the same record as the target that includes it, so
+// that it is not applied twice after a power cycle. The settings are part of the
+// configuration block, which is only saved on request, so the saved offset is kept
+// with a CRC of the settings it was calculated for and discarded if they differ.
+
+// Filtered temperatures are stored with extra fractional bits
+#define FILTER_BITS 4
+
+// Each reading moves the filtered value by 1 / 2^FILTER_SHIFT of the difference
+#define FILTER_SHIFT 2
+
+typedef struct
+{
+    // Copy of the configured settings
+    compensation_settings settings;
+
+    // Offset (steps) that has been added to the channel target
+    int32_t offset;
+
+    // Filtered temperature (1/16 C) that the offset was calculated for
+    int16_t applied;
+
+    // False until the offset has been calculated for the first time
+    bool initialized;
+} compensation_state;
+
+static compensation_state state[CHANNEL_COUNT];
+
+// Filtered temperature for each channel, in 1/16 C << FILTER_BITS
+static int32_t filtered[CHANNEL_COUNT];
+static bool filtered_valid[CHANNEL_COUNT];
+
+// Conversion time of the last reading that was filtered
+static uint32_t last_sweep_time;
+
+static uint8_t settings_crc(const compensation_settings *settings)
+{
+    const uint8_t *bytes = (const uint8_t *)settings;
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < sizeof(compensation_settings); i++)
+        crc = _crc_ibutton_update(crc, bytes[i]);
+
+    return crc;
+}
+
+static int32_t calculate_offset(uint8_t i, int16_t temperature)
+{
+    compensation_settings *s = &state[i].settings;
+    return lroundf(s->coefficient * (temperature - s->reference) / 16);
+}
+
+void compensation_initialize(void)
+{
+    config_data *config = config_get();
+    journal_channel channels[CHANNEL_COUNT];
+    bool journal_valid = journal_load(channels);
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        compensation_state *c = &state[i];
+
+        // The offset is discarded if it was calculated for settings that weren't saved
+        c->settings = config->compensation[i];
+        c->initialized = journal_valid && channels[i].compensated && channels[i].settings_crc == settings_crc(&c->settings);
+        c->offset = c->initialized ? channels[i].offset : 0;
+        c->applied = c->initialized ? channels[i].applied : 0;
+    }
+}
+
+// Filter new readings and apply corrections
+// Called from the main loop
+void compensation_update(void)
+{
+    uint32_t sweep_time = temperature_sweep_time();
+    if (sweep_time == last_sweep_time)
+        return;
+
+    last_sweep_time = sweep_time;
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        compensation_state *c = &state[i];
+        if (!c->settings.probe)
+            continue;
+
+        int16_t reading;
+        if (!temperature_probe_reading(temperature_find_index(c->settings.probe), &reading))
+            continue;
+
+        if (!filtered_valid[i])
+        {
+            filtered[i] = (int32_t)reading << FILTER_BITS;
+            filtered_valid[i] = true;
+        }
+        else
+            filtered[i] += (((int32_t)reading << FILTER_BITS) - filtered[i]) >> FILTER_SHIFT;
+
+        int16_t temperature = filtered[i] >> FILTER_BITS;
+        if (!c->initialized)
+        {
+            // The current position is assumed to be in focus when compensation is enabled
+            c->offset = calculate_offset(i, temperature);
+            c->applied = temperature;
+            c->initialized = true;
+            stepper_request_save(i);
+            continue;
+        }
+
+        if (abs(temperature - c->applied) <= c->settings.deadband)
+            continue;
+
+        int32_t offset = calculate_offset(i, temperature);
+        stepper_offset_target(i, offset - c->offset);
+        c->offset = offset;
+        c->applied = temperature;
+    }
+}
+
+// Fill the compensation state that is saved in the journal with the channel position
+void compensation_journal_state(uint8_t i, journal_channel *channel)
+{
+    compensation_state *c = &state[i];
+    channel->compensated = c->initialized;
+    channel->settings_crc = c->initialized ? settings_crc(&c->settings) : 0;
+    channel->offset = c->initialized ? c->offset : 0;
+    channel->applied = c->initialized ? c->applied : 0;
+}
+
+void compensation_get(uint8_t i, compensation_settings *settings, int32_t *offset, int16_t *temperature, bool *temperature_valid)
+{
+    *settings = state[i].settings;
+    *offset = state[i].offset;
+    *temperature = filtered[i] >> FILTER_BITS;
+    *temperature_valid = filtered_valid[i];
+}
+
+// Replace the compensation settings for a channel.
+// The offset is recalculated from the next reading without moving the channel.
+// The settings are kept after a power cycle once the configuration is saved.
+// Returns false if the settings are invalid.
+bool compensation_set(uint8_t i, const compensation_settings *settings)
+{
+    if (settings->probe > TEMPERATURE_MAX_PROBES || !isfinite(settings->coefficient))
+        return false;
+
+    config_get()->compensation[i] = *settings;
+    state[i].settings = *settings;
+    state[i].offset = 0;
+    state[i].initialized = false;
+    filtered_valid[i] = false;
+    stepper_request_save(i);
+    return true;
+}
@@ -0,0 +1,33 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "journal.h"
+
+#ifndef FOCUSER_COMPENSATION_H
+#define FOCUSER_COMPENSATION_H
+
+typedef struct
+{
+    // 1-based probe index, or 0 if compensation is disabled
+    uint8_t probe;
+
+    // Temperature (1/16 C) where the compensation offset is zero
+    int16_t reference;
+
+    // Focus change in steps per degree C
+    float coefficient;
+
+    // Minimum change in filtered temperature (1/16 C) before a correction is applied
+    uint16_t deadband;
+} compensation_settings;
+
+void compensation_initialize(void);
+void compensation_update(void);
+void compensation_get(uint8_t i, compensation_settings *settings, int32_t *offset, int16_t *temperature, bool *temperature_valid);
+bool compensation_set(uint8_t i, const compensation_settings *settings);
+void compensation_journal_state(uint8_t i, journal_channel *channel);
+
+#endif
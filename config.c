@@ -0,0 +1,68 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/eeprom.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "config.h"
+
+// The settings are loaded into RAM once at startup, and are only written back to
+// EEPROM by an explicit save. Modules read and change them through config_get.
+// The block is stored with a version and CRC, and is replaced by the defaults if
+// either doesn't match (e.g. erased EEPROM or a firmware with a different layout).
+
+// After the stepper positions saved by earlier firmware
+#define CONFIG_EEPROM_ADDRESS 0x80
+
+typedef struct
+{
+    uint8_t version;
+    uint16_t crc;
+    config_data data;
+} config_block;
+
+static config_data config;
+
+static uint16_t crc16(const config_data *data)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < sizeof(config_data); i++)
+        crc = _crc16_update(crc, bytes[i]);
+
+    return crc;
+}
+
+void config_initialize(void)
+{
+    config_block block;
+    eeprom_read_block(&block, (const void *)CONFIG_EEPROM_ADDRESS, sizeof(config_block));
+
+    if (block.version == CONFIG_VERSION && block.crc == crc16(&block.data))
+        config = block.data;
+    else
+    {
+        // Compensation disabled on every channel, all probes read every conversion
+        memset(&config, 0, sizeof(config_data));
+    }
+}
+
+config_data *config_get(void)
+{
+    return &config;
+}
+
+// Write the current settings to EEPROM
+// Called from the main loop; only the bytes that have changed are written
+void config_save(void)
+{
+    config_block block;
+    block.version = CONFIG_VERSION;
+    block.data = config;
+    block.crc = crc16(&block.data);
+
+    eeprom_update_block(&block, (void *)CONFIG_EEPROM_ADDRESS, sizeof(config_block));
+}
@@ -0,0 +1,29 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "compensation.h"
+#include "stepper.h"
+
+#ifndef FOCUSER_CONFIG_H
+#define FOCUSER_CONFIG_H
+
+// Increment when config_data changes so that older blocks are replaced by defaults
+#define CONFIG_VERSION 1
+
+typedef struct
+{
+    // Temperature compensation for each channel
+    compensation_settings compensation[CHANNEL_COUNT];
+
+    // Only read the probes that are outside their alarm band
+    bool alarm_mode;
+} config_data;
+
+void config_initialize(void);
+config_data *config_get(void);
+void config_save(void);
+
+#endif
@@ -9,43 +9,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <util/crc16.h>
-#include <util/delay.h>
 #include "ds18b20.h"
 
 // Command bytes
+static const uint8_t kMatchRomCommand = 0x55;
+static const uint8_t kSkipRomCommand = 0xCC;
+static const uint8_t kSearchRomCommand = 0xF0;
+static const uint8_t kAlarmSearchCommand = 0xEC;
 static const uint8_t kConvertCommand = 0x44;
 static const uint8_t kReadScatchPad = 0xBE;
+static const uint8_t kWriteScatchPad = 0x4E;
+static const uint8_t kCopyScatchPad = 0x48;
+static const uint8_t kReadPowerSupply = 0xB4;
 
 // Scratch pad data indexes
 static const uint8_t kScratchPad_tempLSB = 0;
 static const uint8_t kScratchPad_tempMSB = 1;
+static const uint8_t kScratchPad_alarmHigh = 2;
 static const uint8_t kScratchPad_crc = 8;
+static const uint8_t kScratchPadLength = 9;
 
-// Special return values
-static const uint16_t kDS18B20_DeviceNotFound = 0xA800;
-static const uint16_t kDS18B20_CrcCheckFailed = 0x5000;
+// Number of scratch pad reads that failed the CRC check
+static uint16_t crc_failures;
 
-/**
- * State for the onewire_search function
- * This must be initialised with onewire_search_init() before use.
- */
-typedef struct onewire_search_state {
-
-    // The highest bit position where a bit was ambiguous and a zero was written
-    int8_t lastZeroBranch;
-
-    // Internal flag to indicate if the search is complete
-    // This flag is set once there are no more branches to search
-    bool done;
-
-    // Discovered 64-bit device address (LSB first)
-    // After a successful search, this contains the found device address.
-    // During a search this is overwritten LSB-first with a new address.
-    uint8_t address[8];
-
-} onewire_search_state;
-
-static uint8_t crc8(uint8_t* data, uint8_t len)
+static uint8_t crc8(const uint8_t* data, uint8_t len)
 {
     uint8_t crc = 0;
 
@@ -56,359 +43,220 @@ static uint8_t crc8(uint8_t* data, uint8_t len)
     return crc;
 }
 
-static bool onewire_reset(const gpin_t* io)
+// The bus transactions below are run in the background by the onewire engine.
+// Each ds18b20_start_* function returns false if the bus is busy, and the result
+// is collected by the matching ds18b20_finish_* function once ds18b20_busy()
+// returns false.
+void ds18b20_initialize(const gpin_t* io)
 {
-    // Configure for output
-    gpio_output_set_high(io);
-    gpio_configure_output(io);
-
-    // Pull low for >480uS (master reset pulse)
-    gpio_output_set_low(io);
-    _delay_us(480);
-
-    // Configure for input
-    gpio_configure_input_hiz(io);
-    _delay_us(70);
-
-    // Look for the line pulled low by a slave
-    uint8_t result = gpio_input_read(io);
-
-    // Wait for the presence pulse to finish
-    // This should be less than 240uS, but the master is expected to stay
-    // in Rx mode for a minimum of 480uS in total
-    _delay_us(460);
-
-    return result == 0;
+    onewire_initialize(io);
 }
 
-/**
- * Output a Write-0 or Write-1 slot on the One Wire bus
- * A Write-1 slot is generated unless the passed value is zero
- */
-static void onewire_write_bit(const gpin_t* io, uint8_t bit)
+bool ds18b20_busy(void)
 {
-    if (bit != 0) { // Write high
-
-        // Pull low for less than 15uS to write a high
-        gpio_output_set_low(io);
-        _delay_us(5);
-        gpio_output_set_high(io);
-
-        // Wait for the rest of the minimum slot time
-        _delay_us(55);
-
-    } else { // Write low
-
-        // Pull low for 60 - 120uS to write a low
-        gpio_output_set_low(io);
-        _delay_us(55);
-
-        // Stop pulling down line
-        gpio_output_set_high(io);
-
-        // Recovery time between slots
-        _delay_us(5);
-    }
+    return onewire_status() == ONEWIRE_BUSY;
 }
 
-// One Wire timing is based on this Maxim application note
-// https://www.maximintegrated.com/en/app-notes/index.mvp/id/126
-static void onewire_write(const gpin_t* io, uint8_t byte)
+void ds18b20_search_begin(onewire_search_state* state)
 {
-    // Configure for output
-    gpio_output_set_low(io);
-    gpio_configure_output(io);
-
-    for (uint8_t i = 8; i != 0; --i) {
-
-        onewire_write_bit(io, byte & 0x1);
-
-        // Next bit (LSB first)
-        byte >>= 1;
-    }
+    onewire_search_init(state);
 }
 
-/**
- * Generate a read slot on the One Wire bus and return the bit value
- * Return 0x0 or 0x1
- */
-static uint8_t onewire_read_bit(const gpin_t* io)
+// Start searching for the next device address
+// Returns false if the bus is busy or the previous search found the last device
+bool ds18b20_start_search(onewire_search_state* state)
 {
-    // Pull the 1-wire bus low for >1uS to generate a read slot
-    gpio_output_set_low(io);
-    gpio_configure_output(io);
-    _delay_us(1);
-
-    // Configure for reading (releases the line)
-    gpio_configure_input_hiz(io);
-
-    // Wait for value to stabilise (bit must be read within 15uS of read slot)
-    _delay_us(10);
-
-    uint8_t result = gpio_input_read(io) != 0;
-
-    // Wait for the end of the read slot
-    _delay_us(50);
-
-    return result;
+    return onewire_start_search(kSearchRomCommand, state);
 }
 
-static uint8_t onewire_read(const gpin_t* io)
+// Start searching for the next device address that has its alarm flag set
+// Devices set their alarm flag after a conversion if the temperature is above TH or below TL
+bool ds18b20_start_alarm_search(onewire_search_state* state)
 {
-    uint8_t buffer = 0x0;
-
-    // Configure for input
-    gpio_configure_input_hiz(io);
-
-    // Read 8 bits (LSB first)
-    for (uint8_t bit = 0x01; bit; bit <<= 1) {
-
-        // Copy read bit to least significant bit of buffer
-        if (onewire_read_bit(io)) {
-            buffer |= bit;
-        }
-    }
-
-    return buffer;
+    return onewire_start_search(kAlarmSearchCommand, state);
 }
 
-static void onewire_match_rom(const gpin_t* io, uint8_t* address)
+// Returns true if the search found a new address with a valid CRC
+bool ds18b20_finish_search(onewire_search_state* state)
 {
-    // Write Match Rom command on bus
-    onewire_write(io, 0x55);
+    if (onewire_status() != ONEWIRE_DONE)
+        return false;
 
-    // Send the passed address
-    for (uint8_t i = 0; i < 8; ++i) {
-        onewire_write(io, address[i]);
-    }
+    // Validate bits 0..56 (bytes 0 - 6) against the CRC in byte 7 (bits 57..63)
+    return state->address[7] == crc8(state->address, 7);
 }
 
-static void onewire_skiprom(const gpin_t* io)
+// Returns true if the last search step was corrupted: no device answered one
+// of the address bits, or the address failed its CRC. The devices after it were
+// not reached, so the results of the search are incomplete.
+bool ds18b20_search_failed(const onewire_search_state* state)
 {
-    onewire_write(io, 0xCC);
+    uint8_t status = onewire_status();
+    return status == ONEWIRE_SEARCH_FAILED ||
+        (status == ONEWIRE_DONE && state->address[7] != crc8(state->address, 7));
 }
 
-/**
- * Search procedure for the next ROM addresses
- *
- * This algorithm is bit difficult to understand from the diagrams in Maxim's
- * datasheets and app notes, though its reasonably straight forward once
- * understood.  I've used the name "last zero branch" instead of Maxim's name
- * "last discrepancy", since it describes how this variable is used.
- *
- * A device address has 64 bits. With multiple devices on the bus, some bits
- * are ambiguous.  Each time an ambiguous bit is encountered, a zero is written
- * and the position is marked.  In subsequent searches at ambiguous bits, a one
- * is written at this mark, zeros are written after the mark, and the bit in
- * the previous address is copied before the mark. This effectively steps
- * through all addresses present on the bus.
- *
- * For reference, see either of these documents:
- *
- *  - Maxim application note 187: 1-Wire Search Algorithm
- *    https://www.maximintegrated.com/en/app-notes/index.mvp/id/187
- *
- *  - Maxim application note 937: Book of iButton® Standards (pages 51-54)
- *    https://www.maximintegrated.com/en/app-notes/index.mvp/id/937
- *
- * @see onewire_search()
- * @returns true if a new address was found
- */
-static bool _search_next(const gpin_t* io, onewire_search_state* state)
+// Start a temperature conversion on all devices
+bool ds18b20_start_convert(void)
 {
-    // States of ROM search reads
-    enum {
-        kConflict = 0b00,
-        kZero = 0b10,
-        kOne = 0b01,
-    };
-
-    // Value to write to the current position
-    uint8_t bitValue = 0;
-
-    // Keep track of the last zero branch within this search
-    // If this value is not updated, the search is complete
-    int8_t localLastZeroBranch = -1;
-
-    for (int8_t bitPosition = 0; bitPosition < 64; ++bitPosition) {
-
-        // Calculate bitPosition as an index in the address array
-        // This is written as-is for readability. Compilers should reduce this to bit shifts and tests
-        uint8_t byteIndex = bitPosition / 8;
-        uint8_t bitIndex = bitPosition % 8;
-
-        // Configure bus pin for reading
-        gpio_configure_input_hiz(io);
-
-        // Read the current bit and its complement from the bus
-        uint8_t reading = 0;
-        reading |= onewire_read_bit(io); // Bit
-        reading |= onewire_read_bit(io) << 1; // Complement of bit (negated)
-
-        switch (reading) {
-            case kZero:
-            case kOne:
-                // Bit was the same on all responding devices: it is a known value
-                // The first bit is the value we want to write (rather than its complement)
-                bitValue = (reading & 0x1);
-                break;
-
-            case kConflict:
-                // Both 0 and 1 were written to the bus
-                // Use the search state to continue walking through devices
-                if (bitPosition == state->lastZeroBranch) {
-                    // Current bit is the last position the previous search chose a zero: send one
-                    bitValue = 1;
-
-                } else if (bitPosition < state->lastZeroBranch) {
-                    // Before the lastZeroBranch position, repeat the same choices as the previous search
-                    bitValue = state->address[byteIndex] & (1 << bitIndex);
-
-                } else {
-                    // Current bit is past the lastZeroBranch in the previous search: send zero
-                    bitValue = 0;
-                }
-
-                // Remember the last branch where a zero was written for the next search
-                if (bitValue == 0) {
-                    localLastZeroBranch = bitPosition;
-                }
-
-                break;
-
-            default:
-                // If we see "11" there was a problem on the bus (no devices pulled it low)
-                return false;
-        }
-
-        // Write bit into address
-        if (bitValue == 0) {
-            state->address[byteIndex] &= ~(1 << bitIndex);
-        } else {
-            state->address[byteIndex] |= (bitValue << bitIndex);
-        }
-
-        // Configure for output
-        gpio_output_set_high(io);
-        gpio_configure_output(io);
-
-        // Write bit to the bus to continue the search
-        onewire_write_bit(io, bitValue);
-    }
-
-    // If the no branch points were found, mark the search as done.
-    // Otherwise, mark the last zero branch we found for the next search
-    if (localLastZeroBranch == -1) {
-        state->done = true;
-    } else {
-        state->lastZeroBranch = localLastZeroBranch;
-    }
-
-    // Read a whole address - return success
-    return true;
+    // Send convert command to all devices (this has no response)
+    const uint8_t command[] = { kSkipRomCommand, kConvertCommand };
+    return onewire_start(command, sizeof(command), 0);
 }
 
-static inline bool _search_devices(uint8_t command, const gpin_t* io, onewire_search_state* state)
+// Returns false if no devices responded to the reset pulse
+bool ds18b20_finish_convert(void)
 {
-    // Bail out if the previous search was the end
-    if (state->done) {
-        return false;
-    }
-
-    if (!onewire_reset(io)) {
-        // No devices present on the bus
-        return false;
-    }
-
-    onewire_write(io, command);
-    return _search_next(io, state);
+    return onewire_status() == ONEWIRE_DONE;
 }
 
-static bool onewire_search(const gpin_t* io, onewire_search_state* state)
+// Start a read slot to poll whether the conversion has completed
+// Externally powered devices hold the bus low until their conversion is complete.
+// Parasite-powered devices can't, so they read as complete immediately.
+bool ds18b20_start_poll(void)
 {
-    // Search with "Search ROM" command
-    return _search_devices(0xF0, io, state);
+    return onewire_start_read_slot();
 }
 
-static bool onewire_check_rom_crc(onewire_search_state* state)
+// Returns true if every device has finished converting
+bool ds18b20_finish_poll(void)
 {
-    // Validate bits 0..56 (bytes 0 - 6) against the CRC in byte 7 (bits 57..63)
-    return state->address[7] == crc8(state->address, 7);
+    return onewire_status() == ONEWIRE_DONE && (onewire_received()[0] & 0x01);
 }
 
-void ds18b20_search(const gpin_t* io, uint8_t *found, uint8_t *buf, uint16_t len)
+// Start asking whether any device is parasite-powered
+bool ds18b20_start_read_power(void)
 {
-    onewire_search_state state;
-    state.lastZeroBranch = -1;
-    state.done = false;
-    memset(state.address, 0, sizeof(state.address));
+    const uint8_t command[] = { kSkipRomCommand, kReadPowerSupply };
+    return onewire_start(command, sizeof(command), 1);
+}
 
-    uint8_t i = 0;
-    while (onewire_search(io, &state) && 8 * (i + 1) <= len)
-        if (onewire_check_rom_crc(&state))
-            memcpy(&buf[8 * i++], &state.address, 8);
+// Returns false if no devices responded to the reset pulse
+// Otherwise sets parasite if any device pulled the bus low in the read slots
+bool ds18b20_finish_read_power(bool *parasite)
+{
+    if (onewire_status() != ONEWIRE_DONE)
+        return false;
 
-    *found = i;
+    *parasite = !(onewire_received()[0] & 0x01);
+    return true;
 }
 
-static uint16_t ds18b20_readScratchPad(const gpin_t* io)
+// Start reading the result of the last conversion from a single device
+bool ds18b20_start_read(const uint8_t address[8])
 {
-    // Read scratchpad into buffer (LSB byte first)
-    static const int8_t kScratchPadLength = 9;
-    uint8_t buffer[kScratchPadLength];
+    uint8_t command[10];
+    command[0] = kMatchRomCommand;
+    memcpy(&command[1], address, 8);
+    command[9] = kReadScatchPad;
 
-    for (int8_t i = 0; i < kScratchPadLength; ++i) {
-        buffer[i] = onewire_read(io);
-    }
+    return onewire_start(command, sizeof(command), kScratchPadLength);
+}
+
+// Returns false if the device didn't respond or the scratch pad failed the CRC check
+// Otherwise sets the reading and the TH, TL and configuration registers
+bool ds18b20_finish_read(int16_t *reading, uint8_t config[DS18B20_CONFIG_LENGTH])
+{
+    if (onewire_status() != ONEWIRE_DONE)
+        return false;
 
     // Check the CRC (9th byte) against the 8 bytes of data
+    const uint8_t *buffer = onewire_received();
     if (crc8(buffer, 8) != buffer[kScratchPad_crc]) {
-        return kDS18B20_CrcCheckFailed;
+        crc_failures++;
+        return false;
     }
 
+    memcpy(config, &buffer[kScratchPad_alarmHigh], DS18B20_CONFIG_LENGTH);
+
     // Return the raw 9 to 12-bit temperature value
-    return (buffer[kScratchPad_tempMSB] << 8) | buffer[kScratchPad_tempLSB];
+    // The low bits are undefined at resolutions below 12 bits
+    uint8_t undefined_bits = 12 - ds18b20_resolution(config);
+    *reading = (int16_t)((buffer[kScratchPad_tempMSB] << 8) | buffer[kScratchPad_tempLSB]);
+    *reading &= ~((1 << undefined_bits) - 1);
+    return true;
 }
 
-static uint16_t ds18b20_read_slave(const gpin_t* io, uint8_t* address)
+// Start writing the TH, TL and configuration registers to a device's scratch pad
+bool ds18b20_start_write_config(const uint8_t address[8], const uint8_t config[DS18B20_CONFIG_LENGTH])
 {
-    // Confirm the device is still alive. Abort if no reply
-    if (!onewire_reset(io)) {
-        return kDS18B20_DeviceNotFound;
-    }
+    uint8_t command[10 + DS18B20_CONFIG_LENGTH];
+    command[0] = kMatchRomCommand;
+    memcpy(&command[1], address, 8);
+    command[9] = kWriteScatchPad;
+    memcpy(&command[10], config, DS18B20_CONFIG_LENGTH);
+
+    return onewire_start(command, sizeof(command), 0);
+}
 
-    onewire_match_rom(io, address);
-    onewire_write(io, kReadScatchPad);
+// Start copying the TH, TL and configuration registers to a device's EEPROM
+// The device needs DS18B20_COPY_TIME_MS to complete the copy
+bool ds18b20_start_copy_config(const uint8_t address[8])
+{
+    uint8_t command[10];
+    command[0] = kMatchRomCommand;
+    memcpy(&command[1], address, 8);
+    command[9] = kCopyScatchPad;
 
-    // Read the data from the scratch pad
-    return ds18b20_readScratchPad(io);
+    return onewire_start(command, sizeof(command), 0);
 }
 
-void ds18b20_convert(const gpin_t* io)
+// Returns false if the device didn't respond
+bool ds18b20_finish_config(void)
 {
-    // Send convert command to all devices (this has no response)
-    onewire_skiprom(io);
-    onewire_write(io, kConvertCommand);
+    return onewire_status() == ONEWIRE_DONE;
 }
 
-bool ds18b20_measure(const gpin_t* io, uint8_t address[8], char output[10])
+// Resolution in bits (9-12) set in a configuration register
+uint8_t ds18b20_resolution(const uint8_t config[DS18B20_CONFIG_LENGTH])
 {
-    onewire_reset(io);
+    return 9 + ((config[DS18B20_CONFIG_REGISTER] >> 5) & 0x03);
+}
 
-    ds18b20_convert(io);
-    _delay_ms(750);
+void ds18b20_set_resolution(uint8_t config[DS18B20_CONFIG_LENGTH], uint8_t bits)
+{
+    config[DS18B20_CONFIG_REGISTER] = 0x1F | ((bits - 9) << 5);
+}
 
-    uint16_t reading = ds18b20_read_slave(io, address);
-    if (reading == kDS18B20_CrcCheckFailed)
-        return false;
+// Alarm thresholds in whole degrees C set in the TH and TL registers
+void ds18b20_alarm(const uint8_t config[DS18B20_CONFIG_LENGTH], int8_t *low, int8_t *high)
+{
+    *high = (int8_t)config[DS18B20_ALARM_HIGH_REGISTER];
+    *low = (int8_t)config[DS18B20_ALARM_LOW_REGISTER];
+}
 
-    if (reading == kDS18B20_DeviceNotFound)
-        return false;
+void ds18b20_set_alarm(uint8_t config[DS18B20_CONFIG_LENGTH], int8_t low, int8_t high)
+{
+    config[DS18B20_ALARM_HIGH_REGISTER] = (uint8_t)high;
+    config[DS18B20_ALARM_LOW_REGISTER] = (uint8_t)low;
+}
 
+// Maximum conversion time in ms at the given resolution
+uint16_t ds18b20_conversion_time(uint8_t bits)
+{
+    // 93.75ms at 9 bits, doubling for each additional bit
+    return (750 >> (12 - bits)) + 1;
+}
+
+uint16_t ds18b20_crc_failures(void)
+{
+    return crc_failures;
+}
+
+void ds18b20_format(int16_t reading, char output[10])
+{
     memset(output, '\0', 10);
 
-    const uint16_t integer = (reading >> 4);
-    const uint16_t frac = (reading & 0x0F) * 625;
+    // Readings are two's complement in 1/16 degree units
+    uint16_t value = reading;
+    if (reading < 0)
+    {
+        (*output++) = '-';
+        value = -reading;
+    }
+
+    const uint16_t integer = (value >> 4);
+    const uint16_t frac = (value & 0x0F) * 625;
 
     itoa(integer, output, 10);
     output += strlen(output);
@@ -416,12 +264,11 @@ bool ds18b20_measure(const gpin_t* io, uint8_t address[8], char output[10])
 
     if (frac == 0) {
         memset(output, '0', 4);
-        return true;
+        return;
     }
 
     if (frac < 1000)
         (*output++) = '0';
 
     itoa(frac, output, 10);
-    return true;
 }
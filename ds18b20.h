@@ -2,13 +2,54 @@
 //  Copyright 2023 Paul Chote, All Rights Reserved
 //**********************************************************************************
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "gpio.h"
+#include "onewire.h"
 
 #ifndef FOCUSER_DS18B20_H
 #define FOCUSER_DS18B20_H
 
-void ds18b20_search(const gpin_t* io, uint8_t *found, uint8_t *buf, uint16_t len);
-bool ds18b20_measure(const gpin_t* io, uint8_t address[8], char output[10]);
+// First byte of the ROM address of every DS18B20
+#define DS18B20_FAMILY_CODE 0x28
+
+// The TH, TL and configuration registers from the scratch pad
+#define DS18B20_CONFIG_LENGTH 3
+#define DS18B20_ALARM_HIGH_REGISTER 0
+#define DS18B20_ALARM_LOW_REGISTER 1
+#define DS18B20_CONFIG_REGISTER 2
+
+// Supported resolutions, in bits
+#define DS18B20_MIN_RESOLUTION 9
+#define DS18B20_MAX_RESOLUTION 12
+
+// Time to wait after a Copy Scratchpad before resetting the bus
+#define DS18B20_COPY_TIME_MS 10
+
+void ds18b20_initialize(const gpin_t* io);
+bool ds18b20_busy(void);
+void ds18b20_search_begin(onewire_search_state* state);
+bool ds18b20_start_search(onewire_search_state* state);
+bool ds18b20_start_alarm_search(onewire_search_state* state);
+bool ds18b20_finish_search(onewire_search_state* state);
+bool ds18b20_search_failed(const onewire_search_state* state);
+bool ds18b20_start_convert(void);
+bool ds18b20_finish_convert(void);
+bool ds18b20_start_poll(void);
+bool ds18b20_finish_poll(void);
+bool ds18b20_start_read_power(void);
+bool ds18b20_finish_read_power(bool *parasite);
+bool ds18b20_start_read(const uint8_t address[8]);
+bool ds18b20_finish_read(int16_t *reading, uint8_t config[DS18B20_CONFIG_LENGTH]);
+bool ds18b20_start_write_config(const uint8_t address[8], const uint8_t config[DS18B20_CONFIG_LENGTH]);
+bool ds18b20_start_copy_config(const uint8_t address[8]);
+bool ds18b20_finish_config(void);
+uint8_t ds18b20_resolution(const uint8_t config[DS18B20_CONFIG_LENGTH]);
+void ds18b20_set_resolution(uint8_t config[DS18B20_CONFIG_LENGTH], uint8_t bits);
+void ds18b20_alarm(const uint8_t config[DS18B20_CONFIG_LENGTH], int8_t *low, int8_t *high);
+void ds18b20_set_alarm(uint8_t config[DS18B20_CONFIG_LENGTH], int8_t low, int8_t high);
+uint16_t ds18b20_conversion_time(uint8_t bits);
+uint16_t ds18b20_crc_failures(void);
+void ds18b20_format(int16_t reading, char output[10]);
 
 #endif
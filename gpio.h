@@ -5,6 +5,7 @@
 //**********************************************************************************
 
 #include <avr/io.h>
+#include <util/atomic.h>
 #include <stdint.h>
 
 #ifndef FOCUSER_GPIO_H
@@ -16,10 +17,21 @@ typedef struct gpin_t {
     volatile uint8_t *pin;
     volatile uint8_t *ddr;
 
-    // Bit number in PORT
-    uint8_t bit;
+    // Bit mask in PORT (_BV of the pin number), so no shift is needed at runtime
+    uint8_t mask;
 } gpin_t;
 
+// The pin functions are inlined so that each access is a few instructions rather
+// than a call. They may be used from both the main loop and interrupts, so the
+// read-modify-write is atomic to avoid losing a change made by an interrupt
+// to another pin on the same port.
+//
+// The _isr variants leave out the atomic block, which would only add an SREG
+// save, cli and restore to each access. They must only be used from interrupts
+// or other code that runs with interrupts disabled.
+#ifdef GPIO_EXTERNAL
+
+// Provided by the host build
 void gpio_configure_input_pullup(const gpin_t* pin);
 void gpio_configure_input_hiz(const gpin_t* pin);
 uint8_t gpio_input_read(const gpin_t* pin);
@@ -28,4 +40,71 @@ void gpio_configure_output(const gpin_t* pin);
 void gpio_output_set_high(const gpin_t* pin);
 void gpio_output_set_low(const gpin_t* pin);
 
-#endif
\ No newline at end of file
+void gpio_configure_input_hiz_isr(const gpin_t* pin);
+void gpio_configure_output_isr(const gpin_t* pin);
+void gpio_output_set_high_isr(const gpin_t* pin);
+void gpio_output_set_low_isr(const gpin_t* pin);
+
+#else
+
+static inline void gpio_configure_input_hiz_isr(const gpin_t* pin) {
+    *(pin->ddr) &= ~pin->mask;
+    *(pin->port) &= ~pin->mask;
+}
+
+static inline void gpio_configure_output_isr(const gpin_t* pin) {
+    *(pin->ddr) |= pin->mask;
+}
+
+static inline void gpio_output_set_high_isr(const gpin_t* pin) {
+    *(pin->port) |= pin->mask;
+}
+
+static inline void gpio_output_set_low_isr(const gpin_t* pin) {
+    *(pin->port) &= ~pin->mask;
+}
+
+static inline void gpio_configure_input_pullup(const gpin_t* pin) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *(pin->ddr) &= ~pin->mask;
+        *(pin->port) |= pin->mask;
+    }
+}
+
+static inline void gpio_configure_input_hiz(const gpin_t* pin) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        gpio_configure_input_hiz_isr(pin);
+    }
+}
+
+static inline uint8_t gpio_input_read(const gpin_t* pin) {
+    return *(pin->pin) & pin->mask;
+}
+
+static inline void gpio_configure_output(const gpin_t* pin) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        gpio_configure_output_isr(pin);
+    }
+}
+
+static inline void gpio_output_set_high(const gpin_t* pin) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        gpio_output_set_high_isr(pin);
+    }
+}
+
+static inline void gpio_output_set_low(const gpin_t* pin) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        gpio_output_set_low_isr(pin);
+    }
+}
+
+#endif
+
+// Set the pins in high and clear the pins in low with a single write to port,
+// so that their edges are simultaneous. Must be called with interrupts disabled.
+static inline void gpio_port_write(volatile uint8_t *port, uint8_t high, uint8_t low) {
+    *port = (*port & ~low) | high;
+}
+
+#endif
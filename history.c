@@ -0,0 +1,176 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "history.h"
+
+// Each block of HISTORY_DECIMATION conversions is averaged into a sample, and the
+// most recent HISTORY_LENGTH samples are kept in a ring. This stretches the span
+// of the history to several minutes without using more RAM. Each sample is given
+// a sequence number, so the host can download only the samples that it hasn't
+// seen before. Readings are stored by probe index so that they stay with the same
+// probe when the directory changes.
+// The ring only covers the last HISTORY_LENGTH samples, so the count, min,
+// max and sum of each probe's readings from every conversion are also accumulated
+// since startup or the last history_reset_statistics, however long ago that was.
+
+#if (HISTORY_LENGTH & (HISTORY_LENGTH - 1)) != 0
+    #error HISTORY_LENGTH must be a power of two
+#endif
+
+#define HISTORY_MASK (HISTORY_LENGTH - 1)
+
+typedef struct
+{
+    uint32_t time;
+    int16_t readings[TEMPERATURE_MAX_PROBES];
+} sample;
+
+typedef struct
+{
+    uint32_t count;
+    int32_t sum;
+    int16_t min;
+    int16_t max;
+} running_statistics;
+
+static sample samples[HISTORY_LENGTH];
+static running_statistics running[TEMPERATURE_MAX_PROBES];
+
+// Sequence number that will be given to the next sample
+static uint32_t next_sequence;
+
+// Conversions accumulated for the next sample: the time of the first,
+// and the sum and number of the known readings for each probe
+static uint8_t block_count;
+static uint32_t block_time;
+static int32_t block_sum[TEMPERATURE_MAX_PROBES];
+static uint8_t block_readings[TEMPERATURE_MAX_PROBES];
+
+// Mean of the readings, rounded to the nearest 1/16 C
+static int16_t block_mean(uint8_t i)
+{
+    int32_t sum = block_sum[i];
+    uint8_t n = block_readings[i];
+    if (!n)
+        return HISTORY_READING_UNKNOWN;
+
+    return sum >= 0 ? (sum + n / 2) / n : -((-sum + n / 2) / n);
+}
+
+// Add the readings from a conversion that started at the given device time
+void history_record(uint32_t time, const int16_t readings[TEMPERATURE_MAX_PROBES])
+{
+    if (block_count == 0)
+        block_time = time;
+
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+    {
+        if (readings[i] == HISTORY_READING_UNKNOWN)
+            continue;
+
+        block_sum[i] += readings[i];
+        block_readings[i]++;
+    }
+
+    if (++block_count == HISTORY_DECIMATION)
+    {
+        // The sample is timestamped with the start of its first conversion
+        sample *s = &samples[next_sequence & HISTORY_MASK];
+        s->time = block_time;
+        for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+            s->readings[i] = block_mean(i);
+
+        next_sequence++;
+        block_count = 0;
+        memset(block_sum, 0, sizeof(block_sum));
+        memset(block_readings, 0, sizeof(block_readings));
+    }
+
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+    {
+        running_statistics *r = &running[i];
+        if (readings[i] == HISTORY_READING_UNKNOWN || r->count == HISTORY_MAX_RUNNING_COUNT)
+            continue;
+
+        if (r->count == 0 || readings[i] < r->min)
+            r->min = readings[i];
+        if (r->count == 0 || readings[i] > r->max)
+            r->max = readings[i];
+
+        r->sum += readings[i];
+        r->count++;
+    }
+}
+
+// Start accumulating the running statistics for a probe index again from the next conversion
+void history_reset_statistics(uint8_t slot)
+{
+    memset(&running[slot], 0, sizeof(running_statistics));
+}
+
+uint32_t history_next_sequence(void)
+{
+    return next_sequence;
+}
+
+// Returns the sample with the given sequence number,
+// or false if it hasn't happened yet or is no longer in the history
+bool history_sample(uint32_t sequence, uint32_t *time, const int16_t **readings)
+{
+    if (sequence >= next_sequence || next_sequence - sequence > HISTORY_LENGTH)
+        return false;
+
+    const sample *s = &samples[sequence & HISTORY_MASK];
+    *time = s->time;
+    *readings = s->readings;
+    return true;
+}
+
+// Report the running count, min, max and mean of the readings for a probe index,
+// and the rate of change of the readings in the history.
+// The rate of change is a least-squares fit, so is robust against single noisy readings.
+// Returns false if there are no readings for the probe since the statistics were reset.
+bool history_probe_statistics(uint8_t slot, history_statistics *stats)
+{
+    const running_statistics *r = &running[slot];
+    if (r->count == 0)
+        return false;
+
+    stats->count = r->count;
+    stats->min = r->min;
+    stats->max = r->max;
+    stats->mean = (float)r->sum / r->count;
+
+    uint8_t count = next_sequence < HISTORY_LENGTH ? next_sequence : HISTORY_LENGTH;
+    uint32_t first = next_sequence - count;
+
+    // Times are measured relative to the most recent sample to keep precision
+    uint32_t reference = samples[(next_sequence - 1) & HISTORY_MASK].time;
+    float sum_t = 0, sum_r = 0, sum_tt = 0, sum_tr = 0;
+    uint8_t n = 0;
+
+    for (uint32_t sequence = first; sequence < next_sequence; sequence++)
+    {
+        const sample *s = &samples[sequence & HISTORY_MASK];
+        int16_t reading = s->readings[slot];
+        if (reading == HISTORY_READING_UNKNOWN)
+            continue;
+
+        float t = (int32_t)(s->time - reference) / 60000.0f;
+        sum_t += t;
+        sum_r += reading;
+        sum_tt += t * t;
+        sum_tr += t * reading;
+        n++;
+    }
+
+    float denominator = n * sum_tt - sum_t * sum_t;
+    stats->rate = n > 1 && denominator != 0 ?
+        (n * sum_tr - sum_t * sum_r) / denominator : 0;
+
+    return true;
+}
@@ -0,0 +1,45 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "temperature.h"
+
+#ifndef FOCUSER_HISTORY_H
+#define FOCUSER_HISTORY_H
+
+// Number of conversions that are averaged into each sample of the history
+// (16 seconds at one conversion every 2 seconds)
+#define HISTORY_DECIMATION 8
+
+// Number of samples kept in the history (must be a power of two), each taking
+// 4 + 2 * TEMPERATURE_MAX_PROBES bytes of RAM. This covers the last 256 seconds.
+#define HISTORY_LENGTH 16
+
+// Reading stored for probes that weren't measured in a conversion
+#define HISTORY_READING_UNKNOWN INT16_MIN
+
+// Readings accumulated by the running statistics before they stop counting
+// (about 24 days at one conversion every 2 seconds), so the sum can't overflow
+#define HISTORY_MAX_RUNNING_COUNT (1UL << 20)
+
+typedef struct
+{
+    // Number of readings, min, max and mean in 1/16 C since the statistics were reset
+    uint32_t count;
+    int16_t min;
+    int16_t max;
+    float mean;
+
+    // Rate of change in 1/16 C per minute over the samples in the history
+    float rate;
+} history_statistics;
+
+void history_record(uint32_t time, const int16_t readings[TEMPERATURE_MAX_PROBES]);
+uint32_t history_next_sequence(void);
+bool history_sample(uint32_t sequence, uint32_t *time, const int16_t **readings);
+bool history_probe_statistics(uint8_t slot, history_statistics *stats);
+void history_reset_statistics(uint8_t slot);
+
+#endif
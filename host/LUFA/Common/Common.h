@@ -0,0 +1,15 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the LUFA common definitions used by the firmware.
+
+#include <stddef.h>
+
+#ifndef FOCUSER_HOST_LUFA_COMMON_H
+#define FOCUSER_HOST_LUFA_COMMON_H
+
+#define ATTR_WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...) __attribute__((nonnull(__VA_ARGS__)))
+
+#endif
@@ -0,0 +1,175 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the parts of the LUFA USB device and CDC class driver API
+// that are used by usb.c. The endpoints are emulated by host/sim_usb.c, which also
+// plays the USB host: it sends OUT packets and control requests and reads the
+// IN packets. Names and types follow LUFA so that usb.c compiles unchanged.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <LUFA/Common/Common.h>
+
+#ifndef FOCUSER_HOST_LUFA_USB_H
+#define FOCUSER_HOST_LUFA_USB_H
+
+// Device state
+enum USB_Device_States_t
+{
+    DEVICE_STATE_Unattached,
+    DEVICE_STATE_Powered,
+    DEVICE_STATE_Default,
+    DEVICE_STATE_Addressed,
+    DEVICE_STATE_Configured,
+    DEVICE_STATE_Suspended
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+void USB_Init(void);
+void USB_Device_EnableSOFEvents(void);
+uint16_t USB_Device_GetFrameNumber(void);
+
+// Endpoints
+#define ENDPOINT_DIR_OUT 0x00
+#define ENDPOINT_DIR_IN 0x80
+
+#define EP_TYPE_CONTROL 0x00
+#define EP_TYPE_BULK 0x02
+#define EP_TYPE_INTERRUPT 0x03
+
+typedef struct
+{
+    uint8_t Address;
+    uint16_t Size;
+    uint8_t Type;
+    uint8_t Banks;
+} USB_Endpoint_Table_t;
+
+enum Endpoint_Stream_RW_ErrorCodes_t
+{
+    ENDPOINT_RWSTREAM_NoError,
+    ENDPOINT_RWSTREAM_EndpointStalled,
+    ENDPOINT_RWSTREAM_DeviceDisconnected,
+    ENDPOINT_RWSTREAM_BusSuspended,
+    ENDPOINT_RWSTREAM_Timeout,
+    ENDPOINT_RWSTREAM_IncompleteTransfer
+};
+
+bool Endpoint_ConfigureEndpoint(uint8_t address, uint8_t type, uint16_t size, uint8_t banks);
+uint8_t Endpoint_GetCurrentEndpoint(void);
+void Endpoint_SelectEndpoint(uint8_t address);
+bool Endpoint_IsOUTReceived(void);
+bool Endpoint_IsINReady(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t Endpoint_Read_Stream_LE(void *buffer, uint16_t length, uint16_t *processed);
+uint8_t Endpoint_Write_Stream_LE(const void *buffer, uint16_t length, uint16_t *processed);
+void Endpoint_ClearOUT(void);
+void Endpoint_ClearIN(void);
+
+// Control requests
+typedef struct
+{
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} __attribute__((packed)) USB_Request_Header_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+
+#define CONTROL_REQTYPE_DIRECTION 0x80
+#define CONTROL_REQTYPE_TYPE 0x60
+#define CONTROL_REQTYPE_RECIPIENT 0x1F
+
+#define REQDIR_HOSTTODEVICE (0 << 7)
+#define REQDIR_DEVICETOHOST (1 << 7)
+#define REQTYPE_STANDARD (0 << 5)
+#define REQTYPE_CLASS (1 << 5)
+#define REQTYPE_VENDOR (2 << 5)
+#define REQREC_DEVICE (0 << 0)
+#define REQREC_INTERFACE (1 << 0)
+#define REQREC_ENDPOINT (2 << 0)
+
+enum Endpoint_ControlStream_RW_ErrorCodes_t
+{
+    ENDPOINT_RWCSTREAM_NoError,
+    ENDPOINT_RWCSTREAM_HostAborted,
+    ENDPOINT_RWCSTREAM_DeviceDisconnected,
+    ENDPOINT_RWCSTREAM_BusSuspended
+};
+
+void Endpoint_ClearSETUP(void);
+void Endpoint_ClearStatusStage(void);
+void Endpoint_StallTransaction(void);
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length);
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length);
+
+// CDC class driver
+#define CDC_REQ_SetLineEncoding 0x20
+#define CDC_REQ_GetLineEncoding 0x21
+#define CDC_REQ_SetControlLineState 0x22
+
+#define CDC_CONTROL_LINE_OUT_DTR (1 << 0)
+#define CDC_CONTROL_LINE_OUT_RTS (1 << 1)
+
+typedef struct
+{
+    uint32_t BaudRateBPS;
+    uint8_t CharFormat;
+    uint8_t ParityType;
+    uint8_t DataBits;
+} __attribute__((packed)) CDC_LineEncoding_t;
+
+typedef struct
+{
+    struct
+    {
+        uint8_t ControlInterfaceNumber;
+        USB_Endpoint_Table_t DataINEndpoint;
+        USB_Endpoint_Table_t DataOUTEndpoint;
+        USB_Endpoint_Table_t NotificationEndpoint;
+    } Config;
+
+    struct
+    {
+        struct
+        {
+            uint16_t HostToDevice;
+            uint16_t DeviceToHost;
+        } ControlLineStates;
+
+        CDC_LineEncoding_t LineEncoding;
+    } State;
+} USB_ClassInfo_CDC_Device_t;
+
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *info);
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *info);
+
+// Events implemented by the firmware
+void EVENT_USB_Device_Connect(void);
+void EVENT_USB_Device_Disconnect(void);
+void EVENT_USB_Device_ConfigurationChanged(void);
+void EVENT_USB_Device_ControlRequest(void);
+void EVENT_USB_Device_StartOfFrame(void);
+void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const info);
+
+// Descriptor types used by usb_descriptors.h. The emulated host never requests
+// the descriptors, so usb_descriptors.c isn't built and the types are placeholders.
+typedef struct
+{
+    uint8_t Size;
+    uint8_t Type;
+} USB_Descriptor_Header_t;
+
+typedef USB_Descriptor_Header_t USB_Descriptor_Configuration_Header_t;
+typedef USB_Descriptor_Header_t USB_Descriptor_Interface_Association_t;
+typedef USB_Descriptor_Header_t USB_Descriptor_Interface_t;
+typedef USB_Descriptor_Header_t USB_Descriptor_Endpoint_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalHeader_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalACM_t;
+typedef USB_Descriptor_Header_t USB_CDC_Descriptor_FunctionalUnion_t;
+
+#endif
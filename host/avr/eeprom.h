@@ -0,0 +1,21 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc EEPROM functions, backed by the simulated
+// EEPROM in sim_avr.c. Writes take simulated time like the real EEPROM.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FOCUSER_HOST_AVR_EEPROM_H
+#define FOCUSER_HOST_AVR_EEPROM_H
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+uint32_t eeprom_read_dword(const uint32_t *p);
+
+// Each write completes before eeprom_update_block returns
+#define eeprom_busy_wait()
+
+#endif
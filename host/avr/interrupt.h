@@ -0,0 +1,23 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc interrupt definitions.
+// Interrupt handlers become plain functions that the simulation calls.
+
+#ifndef FOCUSER_HOST_AVR_INTERRUPT_H
+#define FOCUSER_HOST_AVR_INTERRUPT_H
+
+#define ISR(vector, ...) void vector(void)
+#define sei()
+#define cli()
+
+// Interrupt handlers run by sim_avr.c. Timers 0 and 1 and the USB start of
+// frame are only used by the full firmware build, so their handlers may be missing.
+void USB_GEN_vect(void) __attribute__((weak));
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void ANALOG_COMP_vect(void) __attribute__((weak));
+void TIMER3_COMPA_vect(void);
+
+#endif
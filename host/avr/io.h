@@ -0,0 +1,118 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc register definitions.
+// Only the registers used by the firmware are provided. Timers 0, 1 and 3
+// are emulated by sim_avr.c, counting in simulated time, along with the analog
+// comparator. The GPIO ports are
+// plain variables that are read and written by gpio_sim.c. The USB controller
+// is driven through the LUFA API, which is emulated by sim_usb.c.
+
+#include <stdint.h>
+
+#ifndef FOCUSER_HOST_AVR_IO_H
+#define FOCUSER_HOST_AVR_IO_H
+
+#define _BV(bit) (1 << (bit))
+
+// Timer0: device clock
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t OCR0A;
+
+// The counter and flags are calculated from the simulated time on every access.
+// A write to the counter (made by the USB start of frame handler) restarts the
+// timer from the written value. Writes to the flags have no effect.
+volatile uint8_t *sim_timer0_count(void);
+volatile uint8_t *sim_timer0_flags(void);
+#define TCNT0 (*sim_timer0_count())
+#define TIFR0 (*sim_timer0_flags())
+
+#define WGM01 1
+#define CS01 1
+#define CS00 0
+#define OCIE0A 1
+#define OCF0A 1
+
+// Timer1: stepping
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint16_t OCR1A;
+
+#define WGM12 3
+#define CS12 2
+#define CS10 0
+#define OCIE1A 1
+
+// Timer3: 1-wire engine
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint8_t TIMSK3;
+extern volatile uint8_t TIFR3;
+extern volatile uint16_t OCR3A;
+
+uint16_t sim_timer3_count(void);
+#define TCNT3 sim_timer3_count()
+
+#define CS31 1
+#define OCIE3A 1
+#define OCF3A 1
+
+// GPIO
+extern volatile uint8_t PORTB, PINB, DDRB;
+extern volatile uint8_t PORTC, PINC, DDRC;
+extern volatile uint8_t PORTD, PIND, DDRD;
+extern volatile uint8_t PORTF, PINF, DDRF;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB5 5
+#define PB6 6
+#define PD0 0
+#define PD1 1
+#define PD4 4
+#define PD5 5
+#define PD7 7
+#define PF1 1
+
+// USB device interrupts: only the start of frame interrupt is emulated
+extern volatile uint8_t UDIEN;
+
+#define SOFE 2
+
+// Analog comparator: power monitor (POWER_SENSE_ADC)
+// ACO follows the simulated supply (sim_set_supply_failing) on every access, and
+// the interrupt is run by sim_avr.c, so ACI always reads as zero. The ADC and
+// multiplexer registers are plain variables.
+volatile uint8_t *sim_comparator_status(void);
+#define ACSR (*sim_comparator_status())
+
+#define ACBG 6
+#define ACO 5
+#define ACI 4
+#define ACIE 3
+#define ACIS1 1
+#define ACIS0 0
+
+extern volatile uint8_t ADCSRA;
+extern volatile uint8_t ADCSRB;
+extern volatile uint8_t ADMUX;
+extern volatile uint8_t DIDR0;
+extern volatile uint8_t DIDR2;
+
+#define ADEN 7
+#define ACME 6
+#define MUX5 5
+
+// EEPROM size of the atmega32u4
+#define E2END 0x3FF
+
+// EEPROM address and data registers. Writes are made directly by sim_avr.c,
+// so these are only saved and restored by the firmware.
+extern volatile uint16_t EEAR;
+extern volatile uint8_t EEDR;
+
+#endif
@@ -0,0 +1,13 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc program memory definitions.
+// The host has a single address space, so data in program memory is ordinary data.
+
+#ifndef FOCUSER_HOST_AVR_PGMSPACE_H
+#define FOCUSER_HOST_AVR_PGMSPACE_H
+
+#define PROGMEM
+
+#endif
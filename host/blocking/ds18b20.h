@@ -0,0 +1,17 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "gpio.h"
+
+#ifndef FOCUSER_DS18B20_H
+#define FOCUSER_DS18B20_H
+
+void ds18b20_search(const gpin_t* io, uint8_t *found, uint8_t *buf, uint16_t len);
+bool ds18b20_convert(const gpin_t* io);
+bool ds18b20_read(const gpin_t* io, const uint8_t address[8], int16_t *reading);
+void ds18b20_format(int16_t reading, char output[10]);
+
+#endif
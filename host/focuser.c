@@ -0,0 +1,232 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_bus.h"
+#include "sim_firmware.h"
+#include "sim_usb.h"
+
+// Runs the firmware as a Linux process: the serial protocol is spoken over
+// stdin and stdout, the 1-wire probes are simulated, and the EEPROM contents
+// can be kept in a file between runs.
+//
+// This program plays the USB host. Each stdin line is sent to the serial port
+// once the device has accepted the previous one, and the data that the device
+// sends is written to stdout. A line of the form ~<ms> is not sent, but pauses
+// the input for that many milliseconds so that scripts can wait for moves or
+// temperature readings.
+//
+// By default time runs as fast as the host allows. In realtime mode it is paced
+// to the wall clock and stdin is polled instead of blocking, for interactive use.
+// After stdin is closed the firmware keeps running for the exit delay, and for
+// at least EXIT_FLUSH_NS so that the last commands are answered.
+
+// The Makefile renames the firmware main() to firmware_main
+#undef main
+
+#define POLL_NS 1000000ULL
+#define EXIT_FLUSH_NS 20000000ULL
+
+static const char *eeprom_path;
+
+static char input[4096];
+static size_t input_length;
+static bool input_closed;
+
+static uint64_t resume_ns;
+static bool realtime;
+static struct timespec start;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-e eeprom.bin] [-p probes] [-t exit delay s] [-s seed] [-n bit error rate] [-P parasite probes] [-r]\n", name);
+    fprintf(stderr, "  -e  load the EEPROM from this file and save it on exit\n");
+    fprintf(stderr, "  -p  number of simulated temperature probes (default %d)\n", PROBES);
+    fprintf(stderr, "  -t  seconds to keep running after stdin is closed (default 0)\n");
+    fprintf(stderr, "  -s  random seed for the probe addresses and temperatures\n");
+    fprintf(stderr, "  -n  probability that a 1-wire bit is corrupted (default 0)\n");
+    fprintf(stderr, "  -P  number of the probes that are parasite-powered (default 0)\n");
+    fprintf(stderr, "  -r  pace the simulated time to the wall clock\n");
+}
+
+static void save_eeprom(void)
+{
+    if (!sim_eeprom_save(eeprom_path))
+        fprintf(stderr, "failed to save EEPROM to %s\n", eeprom_path);
+}
+
+// Wait until the wall clock catches up with the simulated time
+static void pace(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed_ns = (now.tv_sec - start.tv_sec) * 1000000000LL + now.tv_nsec - start.tv_nsec;
+    int64_t ahead_ns = (int64_t)sim_now_ns() - elapsed_ns;
+    if (ahead_ns > 0)
+    {
+        struct timespec delay = { ahead_ns / 1000000000LL, ahead_ns % 1000000000LL };
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Read more input, returning false if none is available
+static bool fill_input(void)
+{
+    if (realtime)
+    {
+        struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&fd, 1, 0) <= 0)
+            return false;
+    }
+
+    ssize_t n = read(STDIN_FILENO, input + input_length, sizeof(input) - input_length);
+    if (n <= 0)
+    {
+        input_closed = true;
+        return false;
+    }
+
+    input_length += n;
+    return true;
+}
+
+// Send the next input line to the device, returning false if there isn't one yet.
+// Lines longer than the input buffer are sent in pieces.
+static bool send_line(void)
+{
+    for (;;)
+    {
+        char *end = memchr(input, '\n', input_length);
+        if (end || input_length == sizeof(input) || (input_closed && input_length > 0))
+        {
+            size_t length = end ? end - input + 1 : input_length;
+            if (end && input[0] == '~')
+                resume_ns = sim_now_ns() + strtoul(&input[1], NULL, 10) * 1000000ULL;
+            else
+            {
+                sim_usb_send(input, length);
+
+                // Treat a final unterminated line as complete
+                if (!end && input_closed)
+                    sim_usb_send("\n", 1);
+            }
+
+            input_length -= length;
+            memmove(input, input + length, input_length);
+            return true;
+        }
+
+        if (input_closed || !fill_input())
+            return false;
+    }
+}
+
+static void write_output(void)
+{
+    char buffer[1024];
+    size_t length;
+    while ((length = sim_usb_receive(buffer, sizeof(buffer))) > 0)
+        fwrite(buffer, 1, length, stdout);
+
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int probes = PROBES;
+    double exit_delay = 0;
+    unsigned seed = time(NULL);
+    double noise = 0;
+    int parasite = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:p:t:s:n:P:r")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                eeprom_path = optarg;
+                break;
+            case 'p':
+                probes = atoi(optarg);
+                break;
+            case 't':
+                exit_delay = atof(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                noise = atof(optarg);
+                break;
+            case 'P':
+                parasite = atoi(optarg);
+                break;
+            case 'r':
+                realtime = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (probes < 0 || probes > SIM_MAX_DEVICES || exit_delay < 0 || noise < 0 || noise > 1 || parasite < 0 || parasite > probes)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    srand(seed);
+
+    // A missing file starts with an erased EEPROM, as on a new device
+    if (eeprom_path)
+    {
+        sim_eeprom_load(eeprom_path);
+        atexit(save_eeprom);
+    }
+
+    // Probes between 15 and 25 degrees C (1/16 degree units)
+    for (int i = 0; i < probes; i++)
+    {
+        uint8_t rom[8];
+        sim_random_rom(rom);
+        int device = sim_add_device(rom, 15 * 16 + rand() % (10 * 16));
+        sim_set_parasite(device, i < parasite);
+    }
+
+    sim_set_noise(noise);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sim_firmware_start();
+    sim_usb_connect();
+
+    uint64_t exit_ns = UINT64_MAX;
+    while (sim_now_ns() < exit_ns)
+    {
+        // Each command waits until the device has accepted the one before it
+        while (!input_closed && sim_now_ns() >= resume_ns && sim_usb_send_pending() == 0 && send_line())
+            continue;
+
+        if (input_closed && input_length == 0 && exit_ns == UINT64_MAX)
+        {
+            uint64_t delay_ns = exit_delay * 1e9;
+            exit_ns = sim_now_ns() + (delay_ns > EXIT_FLUSH_NS ? delay_ns : EXIT_FLUSH_NS);
+        }
+
+        sim_firmware_run_until(sim_now_ns() + POLL_NS);
+        write_output();
+        if (realtime)
+            pace();
+    }
+
+    return 0;
+}
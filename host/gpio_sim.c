@@ -0,0 +1,117 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "gpio.h"
+#include "sim_avr.h"
+#include "sim_bus.h"
+
+// GPIO backend for the host build.
+// Ordinary pins read and write the simulated port variables, so PIN follows
+// PORT for outputs and reads back the pull-up state for inputs.
+// The pin attached to the 1-wire bus instead drives the simulated bus: the master
+// pulls the bus low while the pin is an output driven low, and releases it
+// otherwise (the bus is pulled high by its resistor).
+// The _isr variants stop the simulation if they are used with interrupts enabled,
+// where the firmware build could lose a change made by an interrupt.
+
+static const gpin_t *bus;
+
+void sim_bus_attach(const gpin_t *pin)
+{
+    bus = pin;
+}
+
+static bool is_bus(const gpin_t *pin)
+{
+    return bus && pin->port == bus->port && pin->mask == bus->mask;
+}
+
+static void update(const gpin_t *pin)
+{
+    bool output = *pin->ddr & pin->mask;
+    bool high = *pin->port & pin->mask;
+    if (is_bus(pin))
+        sim_master_drive(output && !high);
+    else if (high)
+        *pin->pin |= pin->mask;
+    else
+        *pin->pin &= ~pin->mask;
+}
+
+void gpio_configure_input_pullup(const gpin_t* pin)
+{
+    *pin->ddr &= ~pin->mask;
+    *pin->port |= pin->mask;
+    update(pin);
+}
+
+void gpio_configure_input_hiz(const gpin_t* pin)
+{
+    *pin->ddr &= ~pin->mask;
+    *pin->port &= ~pin->mask;
+    update(pin);
+}
+
+uint8_t gpio_input_read(const gpin_t* pin)
+{
+    if (is_bus(pin))
+        return sim_line_read() ? pin->mask : 0;
+
+    return *pin->pin & pin->mask;
+}
+
+void gpio_configure_output(const gpin_t* pin)
+{
+    *pin->ddr |= pin->mask;
+    update(pin);
+}
+
+void gpio_output_set_high(const gpin_t* pin)
+{
+    *pin->port |= pin->mask;
+    update(pin);
+}
+
+void gpio_output_set_low(const gpin_t* pin)
+{
+    *pin->port &= ~pin->mask;
+    update(pin);
+}
+
+static void check_interrupts_disabled(const char *function)
+{
+    if (sim_interrupts_enabled())
+    {
+        fprintf(stderr, "%s called with interrupts enabled\n", function);
+        abort();
+    }
+}
+
+void gpio_configure_input_hiz_isr(const gpin_t* pin)
+{
+    check_interrupts_disabled(__func__);
+    gpio_configure_input_hiz(pin);
+}
+
+void gpio_configure_output_isr(const gpin_t* pin)
+{
+    check_interrupts_disabled(__func__);
+    gpio_configure_output(pin);
+}
+
+void gpio_output_set_high_isr(const gpin_t* pin)
+{
+    check_interrupts_disabled(__func__);
+    gpio_output_set_high(pin);
+}
+
+void gpio_output_set_low_isr(const gpin_t* pin)
+{
+    check_interrupts_disabled(__func__);
+    gpio_output_set_low(pin);
+}
@@ -0,0 +1,17 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Declarations for avr-libc extensions that are used by the firmware sources
+// but aren't provided by the host C library. Included before every source file
+// in the host build.
+
+#ifndef FOCUSER_HOST_H
+#define FOCUSER_HOST_H
+
+char *itoa(int value, char *str, int radix);
+
+// Pins are implemented by host/gpio_sim.c rather than the inline register accesses
+#define GPIO_EXTERNAL
+
+#endif
@@ -0,0 +1,461 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include "sim_avr.h"
+
+// Emulation of the AVR peripherals used by the firmware.
+//
+// Timers count from the simulated time:
+//  - Timer0 (device clock) at F_CPU / 64, 4us per tick, in CTC mode
+//  - Timer1 (stepping) at F_CPU / 1024, 64us per tick, in CTC mode
+//  - Timer3 (1-wire engine) at F_CPU / 8, 2 ticks per microsecond, free running
+// The USB start of frame interrupt runs every millisecond once it is enabled.
+// The analog comparator interrupt runs as soon as the simulated supply crosses
+// the threshold in the direction selected by ACIS1:0.
+// sim_run_until advances the simulated time, running the interrupts in time
+// order. Interrupts don't preempt each other or the calling code, so
+// _delay_us inside an interrupt delays the interrupts that follow it. The Timer3
+// interrupt can also be delayed by a random latency, which models other
+// interrupts delaying it.
+//
+// Interrupts are held off inside an interrupt and inside atomic blocks. The
+// calling code otherwise takes no simulated time, so each atomic block is
+// counted as ATOMIC_BLOCK_NS. This lets code that waits on the device clock
+// see the interrupts run.
+//
+// EEPROM writes take simulated time, during which the interrupts keep running.
+
+#define TIMER0_NS_PER_TICK 4000
+#define TIMER1_NS_PER_TICK 64000
+#define TIMER3_NS_PER_TICK 500
+
+#define FRAME_NS 1000000
+#define ATOMIC_BLOCK_NS 1000
+
+// Time taken to erase and write an EEPROM byte
+#define EEPROM_WRITE_NS 3400000
+
+#define NEVER UINT64_MAX
+
+volatile uint8_t TCCR0A;
+volatile uint8_t TCCR0B;
+volatile uint8_t TIMSK0;
+volatile uint8_t OCR0A;
+
+volatile uint8_t TCCR1B;
+volatile uint8_t TIMSK1;
+volatile uint16_t OCR1A;
+
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint8_t TIMSK3;
+volatile uint8_t TIFR3;
+volatile uint16_t OCR3A;
+
+volatile uint8_t PORTB, PINB, DDRB;
+volatile uint8_t PORTC, PINC, DDRC;
+volatile uint8_t PORTD, PIND, DDRD;
+volatile uint8_t PORTF, PINF, DDRF;
+
+volatile uint8_t UDIEN;
+
+volatile uint8_t ADCSRA;
+volatile uint8_t ADCSRB;
+volatile uint8_t ADMUX;
+volatile uint8_t DIDR0;
+volatile uint8_t DIDR2;
+
+volatile uint16_t EEAR;
+volatile uint8_t EEDR;
+
+static uint64_t now_ns;
+static uint32_t isr_latency_ns;
+static bool interrupts_enabled = true;
+
+// Interrupts have been run up to this time
+static uint64_t processed_ns;
+
+// Time of the last Timer3 compare match that was run
+static uint64_t timer3_ns = NEVER;
+
+// Time of the last USB start of frame that was run
+static uint64_t frame_ns = NEVER;
+
+// Time of the last compare match of the CTC timers
+static uint64_t timer0_base;
+static uint64_t timer1_base;
+
+// TCNT0 as seen by the firmware, and the value that it was last set to by sim_timer0_count.
+// A difference means that the firmware has written the register.
+static uint8_t timer0_count;
+static uint8_t timer0_count_read;
+
+// Analog comparator register as seen by the firmware, the comparator output
+// (high while the supply is failing), and an output change that hasn't been run
+static uint8_t comparator_status;
+static bool comparator_output;
+static bool comparator_pending;
+
+// Erased EEPROM reads as 0xFF
+static uint8_t eeprom[E2END + 1] = { [0 ... E2END] = 0xFF };
+static uint32_t eeprom_writes;
+
+uint64_t sim_now_ns(void)
+{
+    return now_ns;
+}
+
+void sim_set_isr_latency(uint32_t max_ns)
+{
+    isr_latency_ns = max_ns;
+}
+
+// Time of the next compare match of a CTC timer that last matched at base.
+// Matches that happened while the interrupt was disabled only leave its flag set.
+static uint64_t ctc_due(uint64_t *base, uint64_t period)
+{
+    if (now_ns > *base + 2 * period)
+        *base += ((now_ns - *base) / period - 1) * period;
+
+    return *base + period;
+}
+
+static uint64_t timer0_period(void)
+{
+    return (OCR0A + 1ULL) * TIMER0_NS_PER_TICK;
+}
+
+static uint64_t timer1_period(void)
+{
+    return (OCR1A + 1ULL) * TIMER1_NS_PER_TICK;
+}
+
+// Restart the timer from a value written by the firmware
+static void timer0_sync(void)
+{
+    if (timer0_count == timer0_count_read)
+        return;
+
+    timer0_base = now_ns - timer0_count * TIMER0_NS_PER_TICK;
+    timer0_count_read = timer0_count;
+}
+
+static uint64_t timer0_due(void)
+{
+    timer0_sync();
+    if (!TCCR0B || !(TIMSK0 & _BV(OCIE0A)) || !TIMER0_COMPA_vect)
+        return NEVER;
+
+    return ctc_due(&timer0_base, timer0_period());
+}
+
+static uint64_t timer1_due(void)
+{
+    if (!TCCR1B || !(TIMSK1 & _BV(OCIE1A)) || !TIMER1_COMPA_vect)
+        return NEVER;
+
+    return ctc_due(&timer1_base, timer1_period());
+}
+
+volatile uint8_t *sim_timer0_count(void)
+{
+    timer0_sync();
+    uint64_t ticks = (now_ns - timer0_base) / TIMER0_NS_PER_TICK;
+
+    // The timer resets at the compare match, even if the interrupt hasn't run yet
+    if (ticks > OCR0A)
+        ticks -= OCR0A + 1;
+
+    timer0_count = timer0_count_read = ticks;
+    return &timer0_count;
+}
+
+volatile uint8_t *sim_timer0_flags(void)
+{
+    static uint8_t flags;
+    timer0_sync();
+    flags = now_ns >= timer0_base + timer0_period() ? _BV(OCF0A) : 0;
+    return &flags;
+}
+
+uint16_t sim_timer3_count(void)
+{
+    return (now_ns / TIMER3_NS_PER_TICK) & 0xFFFF;
+}
+
+// Time of the first start of frame after the interrupts were last run
+static uint64_t frame_due(void)
+{
+    if (!(UDIEN & _BV(SOFE)) || !USB_GEN_vect)
+        return NEVER;
+
+    uint64_t t = processed_ns / FRAME_NS * FRAME_NS;
+    if (t < processed_ns || t == frame_ns)
+        t += FRAME_NS;
+
+    return t;
+}
+
+volatile uint8_t *sim_comparator_status(void)
+{
+    comparator_status &= ~(_BV(ACO) | _BV(ACI));
+    if (comparator_output)
+        comparator_status |= _BV(ACO);
+
+    return &comparator_status;
+}
+
+void sim_set_supply_failing(bool failing)
+{
+    if (failing != comparator_output)
+        comparator_pending = true;
+
+    comparator_output = failing;
+}
+
+// The comparator interrupt is due immediately if the last output change matches
+// the selected edge, and is otherwise discarded
+static uint64_t comparator_due(void)
+{
+    if (!comparator_pending || !ANALOG_COMP_vect)
+        return NEVER;
+
+    uint8_t edge = comparator_status & (_BV(ACIS1) | _BV(ACIS0));
+    bool rising = edge == (_BV(ACIS1) | _BV(ACIS0));
+    bool falling = edge == _BV(ACIS1);
+    if (!(comparator_status & _BV(ACIE)) || (comparator_output ? falling : rising))
+    {
+        comparator_pending = false;
+        return NEVER;
+    }
+
+    return processed_ns;
+}
+
+// Time of the first Timer3 compare match after the interrupts were last run
+static uint64_t timer3_due(void)
+{
+    if (!(TIMSK3 & _BV(OCIE3A)))
+        return NEVER;
+
+    uint64_t tick = processed_ns / TIMER3_NS_PER_TICK;
+    uint32_t ticks = (uint16_t)(OCR3A - (tick & 0xFFFF));
+
+    // A match at exactly this time is still due if another interrupt ran first
+    if (ticks == 0 && (processed_ns % TIMER3_NS_PER_TICK || processed_ns == timer3_ns))
+        ticks = 0x10000;
+
+    return (tick + ticks) * TIMER3_NS_PER_TICK;
+}
+
+// Run an interrupt handler now, holding off the other interrupts
+void sim_interrupt(void (*vector)(void))
+{
+    bool enabled = interrupts_enabled;
+    interrupts_enabled = false;
+    vector();
+    interrupts_enabled = enabled;
+}
+
+// Advance the simulated time, running the interrupts that are due
+// If interrupts are held off they run once they are enabled again
+void sim_run_until(uint64_t end_ns)
+{
+    if (!interrupts_enabled)
+    {
+        if (now_ns < end_ns)
+            now_ns = end_ns;
+        return;
+    }
+
+    for (;;)
+    {
+        // Ties are run in the order of the interrupt vector priorities
+        uint64_t tu = frame_due();
+        uint64_t t1 = timer1_due();
+        uint64_t t0 = timer0_due();
+        uint64_t ta = comparator_due();
+        uint64_t t3 = timer3_due();
+        uint64_t t = tu < t1 ? tu : t1;
+        if (t0 < t)
+            t = t0;
+        if (ta < t)
+            t = ta;
+        if (t3 < t)
+            t = t3;
+
+        if (t > end_ns)
+            break;
+
+        processed_ns = t;
+        if (now_ns < t)
+            now_ns = t;
+
+        interrupts_enabled = false;
+        if (t == tu)
+        {
+            frame_ns = t;
+            USB_GEN_vect();
+        }
+        else if (t == t1)
+        {
+            timer1_base = t;
+            TIMER1_COMPA_vect();
+        }
+        else if (t == t0)
+        {
+            timer0_base = t;
+            TIMER0_COMPA_vect();
+        }
+        else if (t == ta)
+        {
+            comparator_pending = false;
+            ANALOG_COMP_vect();
+        }
+        else
+        {
+            timer3_ns = t;
+            if (isr_latency_ns)
+                now_ns += rand() % isr_latency_ns;
+
+            TIMER3_COMPA_vect();
+        }
+
+        interrupts_enabled = true;
+    }
+
+    processed_ns = end_ns;
+    if (now_ns < end_ns)
+        now_ns = end_ns;
+}
+
+void sim_advance_ns(uint64_t ns)
+{
+    sim_run_until(now_ns + ns);
+}
+
+// Run the Timer3 compare interrupt until the 1-wire engine disables it
+void sim_run_until_idle(void)
+{
+    while (TIMSK3 & _BV(OCIE3A))
+        sim_run_until(timer3_due());
+}
+
+bool sim_interrupts_enabled(void)
+{
+    return interrupts_enabled;
+}
+
+bool sim_atomic_begin(void)
+{
+    bool enabled = interrupts_enabled;
+    interrupts_enabled = false;
+    return enabled;
+}
+
+void sim_atomic_end(bool enabled)
+{
+    interrupts_enabled = enabled;
+    if (enabled)
+        sim_advance_ns(ATOMIC_BLOCK_NS);
+}
+
+void _delay_us(double us)
+{
+    now_ns += (uint64_t)(us * 1000);
+}
+
+void _delay_ms(double ms)
+{
+    now_ns += (uint64_t)(ms * 1000000);
+}
+
+void sim_eeprom_erase(void)
+{
+    memset(eeprom, 0xFF, sizeof(eeprom));
+}
+
+// Returns false if the file couldn't be read, leaving the EEPROM erased
+bool sim_eeprom_load(const char *path)
+{
+    sim_eeprom_erase();
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    bool ok = fread(eeprom, 1, sizeof(eeprom), f) == sizeof(eeprom);
+    fclose(f);
+    return ok;
+}
+
+bool sim_eeprom_save(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    bool ok = fwrite(eeprom, 1, sizeof(eeprom), f) == sizeof(eeprom);
+    fclose(f);
+    return ok;
+}
+
+// Access the EEPROM contents directly, without taking any simulated time
+void sim_eeprom_read(uint16_t address, void *data, size_t length)
+{
+    memcpy(data, &eeprom[address], length);
+}
+
+void sim_eeprom_write(uint16_t address, const void *data, size_t length)
+{
+    memcpy(&eeprom[address], data, length);
+}
+
+// Number of bytes that have been written
+uint32_t sim_eeprom_writes(void)
+{
+    return eeprom_writes;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, &eeprom[(uintptr_t)src], n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    const uint8_t *bytes = src;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t *e = &eeprom[(uintptr_t)dst + i];
+        if (*e == bytes[i])
+            continue;
+
+        *e = bytes[i];
+        eeprom_writes++;
+        sim_advance_ns(EEPROM_WRITE_NS);
+    }
+}
+
+uint32_t eeprom_read_dword(const uint32_t *p)
+{
+    uint32_t value;
+    eeprom_read_block(&value, p, sizeof(value));
+    return value;
+}
+
+char *itoa(int value, char *str, int radix)
+{
+    // Only decimal is used by the firmware
+    (void)radix;
+    sprintf(str, "%d", value);
+    return str;
+}
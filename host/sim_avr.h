@@ -0,0 +1,32 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FOCUSER_SIM_AVR_H
+#define FOCUSER_SIM_AVR_H
+
+// Simulated time
+uint64_t sim_now_ns(void);
+void sim_run_until(uint64_t end_ns);
+void sim_advance_ns(uint64_t ns);
+void sim_run_until_idle(void);
+void sim_set_isr_latency(uint32_t max_ns);
+void sim_interrupt(void (*vector)(void));
+bool sim_interrupts_enabled(void);
+
+// Simulated motor supply, as seen by the analog comparator
+void sim_set_supply_failing(bool failing);
+
+// Simulated EEPROM
+void sim_eeprom_erase(void);
+bool sim_eeprom_load(const char *path);
+bool sim_eeprom_save(const char *path);
+void sim_eeprom_read(uint16_t address, void *data, size_t length);
+void sim_eeprom_write(uint16_t address, const void *data, size_t length);
+uint32_t sim_eeprom_writes(void);
+
+#endif
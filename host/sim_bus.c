@@ -0,0 +1,394 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "sim_bus.h"
+
+// Bit-level model of a 1-wire bus with DS18B20 devices.
+//
+// The bus is a wired-AND: it reads low if the master or any device is pulling
+// it low. Devices follow the master's falling and rising edges:
+//  - a low pulse of 480us or more is a reset, answered by a presence pulse
+//    from 30us to 150us after the master releases the bus
+//  - otherwise the falling edge starts a time slot. A device that is sending
+//    a zero (or is busy converting) holds the bus low until 30us into the slot.
+//    When the master releases the bus the device samples the bit it wrote:
+//    a one if the low pulse was shorter than 15us.
+//
+// Each device implements the ROM commands (Match, Skip, Search and Alarm
+// Search) and the Convert T, Read, Write and Copy Scratchpad and Read Power
+// Supply function commands, with conversion times that depend on the configured
+// resolution. Parasite-powered devices can't hold the bus low while converting.
+// Bit errors can be injected into the master's reads to test CRC handling.
+
+#define US 1000ULL
+
+#define RESET_MIN_NS (480 * US)
+#define PRESENCE_START_NS (30 * US)
+#define PRESENCE_END_NS (150 * US)
+#define SLOT_HOLD_NS (30 * US)
+#define WRITE_ONE_MAX_NS (15 * US)
+
+// Temperature register value at power on (85 C)
+#define POWER_ON_TEMPERATURE 0x0550
+
+enum device_state
+{
+    DEVICE_IDLE,
+    DEVICE_ROM_COMMAND,
+    DEVICE_MATCH_ROM,
+    DEVICE_SEARCH,
+    DEVICE_FUNCTION_COMMAND,
+    DEVICE_WRITE_SCRATCHPAD,
+    DEVICE_TRANSMIT,
+    DEVICE_POLL,
+    DEVICE_POWER_SUPPLY
+};
+
+typedef struct
+{
+    uint8_t rom[8];
+    int16_t temperature;
+    uint8_t scratchpad[9];
+    uint8_t eeprom[3];
+    bool alarm;
+    bool parasite;
+
+    uint8_t state;
+
+    // Bits received from the master
+    uint8_t rx[8];
+    uint8_t rx_bits;
+
+    // Bits sent to the master
+    uint8_t tx[9];
+    uint8_t tx_bits;
+    uint8_t tx_index;
+
+    // Search progress: bit index and step within the read, complement, write triplet
+    uint8_t search_bit;
+    uint8_t search_step;
+
+    bool converting;
+    uint64_t conversion_done;
+
+    // The device holds the bus low until this time
+    uint64_t hold_until;
+} device;
+
+static device devices[SIM_MAX_DEVICES];
+static uint8_t device_count;
+
+static bool master_low;
+static uint64_t master_fall;
+static uint64_t presence_start;
+static uint64_t presence_end;
+
+static double noise_rate;
+static uint32_t noise_errors;
+
+static uint8_t crc8(const uint8_t *data, uint8_t length)
+{
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++)
+        crc = _crc_ibutton_update(crc, data[i]);
+
+    return crc;
+}
+
+static uint8_t resolution(const device *d)
+{
+    return 9 + ((d->scratchpad[4] >> 5) & 0x03);
+}
+
+static void update_conversion(device *d, uint64_t now)
+{
+    if (!d->converting || now < d->conversion_done)
+        return;
+
+    // Undefined low bits read as zero at lower resolutions
+    uint8_t undefined = 12 - resolution(d);
+    int16_t value = d->temperature & ~((1 << undefined) - 1);
+    d->scratchpad[0] = value & 0xFF;
+    d->scratchpad[1] = (value >> 8) & 0xFF;
+
+    // Alarm if the integer temperature is at or outside TH or TL
+    int8_t integer = value >> 4;
+    d->alarm = integer >= (int8_t)d->scratchpad[2] || integer <= (int8_t)d->scratchpad[3];
+    d->converting = false;
+}
+
+static void start_transmit(device *d, const uint8_t *data, uint8_t length)
+{
+    memcpy(d->tx, data, length);
+    d->tx_bits = 8 * length;
+    d->tx_index = 0;
+    d->state = DEVICE_TRANSMIT;
+}
+
+static bool tx_bit(const device *d)
+{
+    return (d->tx[d->tx_index / 8] >> (d->tx_index % 8)) & 0x01;
+}
+
+static bool rom_bit(const device *d, uint8_t bit)
+{
+    return (d->rom[bit / 8] >> (bit % 8)) & 0x01;
+}
+
+static void function_command(device *d, uint8_t command, uint64_t now)
+{
+    switch (command)
+    {
+        case 0x44:
+        {
+            // Convert T: 93.75ms at 9 bits, doubling for each additional bit
+            d->converting = true;
+            d->conversion_done = now + (93750 * US << (resolution(d) - 9));
+            d->state = DEVICE_POLL;
+            break;
+        }
+        case 0xBE:
+            d->scratchpad[8] = crc8(d->scratchpad, 8);
+            start_transmit(d, d->scratchpad, 9);
+            break;
+        case 0x4E:
+            d->rx_bits = 0;
+            d->state = DEVICE_WRITE_SCRATCHPAD;
+            break;
+        case 0x48:
+            memcpy(d->eeprom, &d->scratchpad[2], 3);
+            d->state = DEVICE_IDLE;
+            break;
+        case 0xB4:
+            d->state = DEVICE_POWER_SUPPLY;
+            break;
+        default:
+            d->state = DEVICE_IDLE;
+            break;
+    }
+}
+
+// Handle a bit written by the master
+static void receive_bit(device *d, bool bit, uint64_t now)
+{
+    uint8_t *rx = d->rx;
+    if (bit)
+        rx[d->rx_bits / 8] |= 1 << (d->rx_bits % 8);
+    else
+        rx[d->rx_bits / 8] &= ~(1 << (d->rx_bits % 8));
+    d->rx_bits++;
+
+    switch (d->state)
+    {
+        case DEVICE_ROM_COMMAND:
+            if (d->rx_bits < 8)
+                break;
+
+            d->rx_bits = 0;
+            if (rx[0] == 0x55)
+                d->state = DEVICE_MATCH_ROM;
+            else if (rx[0] == 0xCC)
+                d->state = DEVICE_FUNCTION_COMMAND;
+            else if (rx[0] == 0xF0 || (rx[0] == 0xEC && d->alarm))
+            {
+                d->search_bit = d->search_step = 0;
+                d->state = DEVICE_SEARCH;
+            }
+            else
+                d->state = DEVICE_IDLE;
+            break;
+        case DEVICE_MATCH_ROM:
+            if (d->rx_bits < 64)
+                break;
+
+            d->rx_bits = 0;
+            d->state = memcmp(rx, d->rom, 8) ? DEVICE_IDLE : DEVICE_FUNCTION_COMMAND;
+            break;
+        case DEVICE_FUNCTION_COMMAND:
+            if (d->rx_bits < 8)
+                break;
+
+            d->rx_bits = 0;
+            function_command(d, rx[0], now);
+            break;
+        case DEVICE_WRITE_SCRATCHPAD:
+            if (d->rx_bits < 24)
+                break;
+
+            memcpy(&d->scratchpad[2], rx, 3);
+            d->state = DEVICE_IDLE;
+            break;
+    }
+}
+
+// The master has pulled the bus low to start a slot
+static void slot_start(device *d, uint64_t now)
+{
+    bool send_zero = false;
+    switch (d->state)
+    {
+        case DEVICE_SEARCH:
+            if (d->search_step < 2)
+                send_zero = rom_bit(d, d->search_bit) == d->search_step;
+            break;
+        case DEVICE_TRANSMIT:
+            send_zero = !tx_bit(d);
+            break;
+        case DEVICE_POLL:
+            send_zero = d->converting && !d->parasite;
+            break;
+        case DEVICE_POWER_SUPPLY:
+            send_zero = d->parasite;
+            break;
+    }
+
+    if (send_zero)
+        d->hold_until = now + SLOT_HOLD_NS;
+}
+
+// The master has released the bus at the end of a low pulse of the given length
+static void slot_end(device *d, uint64_t length, uint64_t now)
+{
+    bool bit = length < WRITE_ONE_MAX_NS;
+    switch (d->state)
+    {
+        case DEVICE_ROM_COMMAND:
+        case DEVICE_MATCH_ROM:
+        case DEVICE_FUNCTION_COMMAND:
+        case DEVICE_WRITE_SCRATCHPAD:
+            receive_bit(d, bit, now);
+            break;
+        case DEVICE_SEARCH:
+            if (d->search_step++ < 2)
+                break;
+
+            // Devices that don't match the master's choice drop out of the search
+            d->search_step = 0;
+            if (bit != rom_bit(d, d->search_bit))
+                d->state = DEVICE_IDLE;
+            else if (++d->search_bit == 64)
+            {
+                d->rx_bits = 0;
+                d->state = DEVICE_FUNCTION_COMMAND;
+            }
+            break;
+        case DEVICE_TRANSMIT:
+            if (++d->tx_index == d->tx_bits)
+                d->state = DEVICE_IDLE;
+            break;
+    }
+}
+
+// Generate a random DS18B20 ROM address with a valid CRC
+void sim_random_rom(uint8_t rom[8])
+{
+    rom[0] = 0x28;
+    for (uint8_t i = 1; i < 7; i++)
+        rom[i] = rand() & 0xFF;
+
+    rom[7] = crc8(rom, 7);
+}
+
+int sim_add_device(const uint8_t rom[8], int16_t temperature)
+{
+    if (device_count == SIM_MAX_DEVICES)
+        return -1;
+
+    device *d = &devices[device_count];
+    memset(d, 0, sizeof(device));
+    memcpy(d->rom, rom, 8);
+    d->temperature = temperature;
+
+    // Factory defaults: TH = 75 C, TL = 70 C, 12 bit resolution
+    const uint8_t scratchpad[9] = { POWER_ON_TEMPERATURE & 0xFF, POWER_ON_TEMPERATURE >> 8, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10, 0 };
+    memcpy(d->scratchpad, scratchpad, 9);
+    memcpy(d->eeprom, &scratchpad[2], 3);
+
+    return device_count++;
+}
+
+// Detach every device from the bus
+void sim_remove_devices(void)
+{
+    device_count = 0;
+}
+
+void sim_set_temperature(int i, int16_t temperature)
+{
+    devices[i].temperature = temperature;
+}
+
+void sim_set_parasite(int i, bool parasite)
+{
+    devices[i].parasite = parasite;
+}
+
+void sim_set_noise(double bit_error_rate)
+{
+    noise_rate = bit_error_rate;
+}
+
+uint32_t sim_noise_errors(void)
+{
+    return noise_errors;
+}
+
+void sim_master_drive(bool low)
+{
+    uint64_t now = sim_now_ns();
+    if (low == master_low)
+        return;
+
+    master_low = low;
+    for (uint8_t i = 0; i < device_count; i++)
+        update_conversion(&devices[i], now);
+
+    if (low)
+    {
+        master_fall = now;
+        for (uint8_t i = 0; i < device_count; i++)
+            slot_start(&devices[i], now);
+        return;
+    }
+
+    uint64_t length = now - master_fall;
+    if (length >= RESET_MIN_NS)
+    {
+        presence_start = device_count ? now + PRESENCE_START_NS : 0;
+        presence_end = device_count ? now + PRESENCE_END_NS : 0;
+        for (uint8_t i = 0; i < device_count; i++)
+        {
+            devices[i].state = DEVICE_ROM_COMMAND;
+            devices[i].rx_bits = 0;
+            devices[i].hold_until = 0;
+        }
+        return;
+    }
+
+    for (uint8_t i = 0; i < device_count; i++)
+        slot_end(&devices[i], length, now);
+}
+
+bool sim_line_read(void)
+{
+    uint64_t now = sim_now_ns();
+    bool low = master_low || (now >= presence_start && now < presence_end);
+    for (uint8_t i = 0; i < device_count; i++)
+        if (now < devices[i].hold_until)
+            low = true;
+
+    // Inject bit errors into the value sampled by the master
+    if (noise_rate > 0 && rand() < noise_rate * RAND_MAX)
+    {
+        noise_errors++;
+        low = !low;
+    }
+
+    return !low;
+}
@@ -0,0 +1,32 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sim_avr.h"
+
+#ifndef FOCUSER_SIM_BUS_H
+#define FOCUSER_SIM_BUS_H
+
+// Maximum number of simulated devices on the bus
+#define SIM_MAX_DEVICES 32
+
+// Simulated devices
+void sim_random_rom(uint8_t rom[8]);
+int sim_add_device(const uint8_t rom[8], int16_t temperature);
+void sim_remove_devices(void);
+void sim_set_temperature(int device, int16_t temperature);
+void sim_set_parasite(int device, bool parasite);
+void sim_set_noise(double bit_error_rate);
+uint32_t sim_noise_errors(void);
+
+// The firmware pin that is connected to the bus
+struct gpin_t;
+void sim_bus_attach(const struct gpin_t *pin);
+
+// Called by the GPIO backend
+void sim_master_drive(bool low);
+bool sim_line_read(void);
+
+#endif
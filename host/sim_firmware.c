@@ -0,0 +1,82 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include "gpio.h"
+#include "sim_avr.h"
+#include "sim_bus.h"
+#include "sim_firmware.h"
+
+// Runs the firmware main() as a coroutine, so that the host program or a test
+// can act as the USB host between passes of the firmware main loop.
+//
+// The main loop calls usb_read_line on every pass, so the build redirects the
+// firmware's calls to __wrap_usb_read_line (-Wl,--wrap=usb_read_line). Each
+// call takes MAIN_LOOP_NS of simulated time, running the interrupts that are
+// due, and switches back to the caller once the requested time is reached.
+//
+// The firmware main() is renamed to firmware_main by the Makefile.
+#undef main
+int firmware_main(void);
+
+#define MAIN_LOOP_NS 50000
+#define STACK_SIZE (256 * 1024)
+
+extern gpin_t onewire_bus;
+
+static ucontext_t firmware_context;
+static ucontext_t caller_context;
+static uint64_t run_until_ns;
+
+int16_t __real_usb_read_line(char **line);
+
+int16_t __wrap_usb_read_line(char **line)
+{
+    sim_advance_ns(MAIN_LOOP_NS);
+    if (sim_now_ns() >= run_until_ns)
+        swapcontext(&firmware_context, &caller_context);
+
+    return __real_usb_read_line(line);
+}
+
+static void firmware_entry(void)
+{
+    firmware_main();
+}
+
+// Start the firmware and run its initialization, up to the first pass of the
+// main loop. The simulated probes must be added first.
+void sim_firmware_start(void)
+{
+    sim_bus_attach(&onewire_bus);
+
+    getcontext(&firmware_context);
+    firmware_context.uc_stack.ss_sp = malloc(STACK_SIZE);
+    firmware_context.uc_stack.ss_size = STACK_SIZE;
+    firmware_context.uc_link = NULL;
+    if (!firmware_context.uc_stack.ss_sp)
+    {
+        fprintf(stderr, "failed to allocate the firmware stack\n");
+        exit(1);
+    }
+
+    makecontext(&firmware_context, firmware_entry, 0);
+    sim_firmware_run_until(sim_now_ns());
+}
+
+// Run the firmware main loop until the simulated time reaches end_ns
+void sim_firmware_run_until(uint64_t end_ns)
+{
+    run_until_ns = end_ns;
+    swapcontext(&caller_context, &firmware_context);
+}
+
+void sim_firmware_run_ms(uint32_t ms)
+{
+    sim_firmware_run_until(sim_now_ns() + ms * 1000000ULL);
+}
@@ -0,0 +1,15 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdint.h>
+
+#ifndef FOCUSER_SIM_FIRMWARE_H
+#define FOCUSER_SIM_FIRMWARE_H
+
+// Run the firmware main loop in simulated time
+void sim_firmware_start(void);
+void sim_firmware_run_until(uint64_t end_ns);
+void sim_firmware_run_ms(uint32_t ms);
+
+#endif
@@ -0,0 +1,380 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <LUFA/Drivers/USB/USB.h>
+#include "usb_descriptors.h"
+#include "sim_avr.h"
+#include "sim_usb.h"
+
+// Emulation of the USB controller endpoints used by usb.c, and of the USB host.
+//
+// Each endpoint has one or two banks. The firmware reads OUT banks that the
+// host has filled, and fills IN banks for the host to read. At the start of each
+// frame (USB_GEN_vect, run every millisecond by sim_avr.c once the firmware
+// enables SOF events) the host reads every filled IN bank and moves queued
+// OUT packets into the free banks, before the firmware's SOF event runs.
+// Serial data sent by the host is split into packets of up to CDC_TXRX_EPSIZE
+// bytes, and a bank is only refilled once the firmware has released it, so a
+// firmware that stops reading holds up the host as on a real bus.
+// Control requests are handled immediately, from the simulated USB interrupt.
+
+#define MAX_ENDPOINTS 8
+#define MAX_BANKS 2
+#define MAX_PACKET_SIZE 64
+
+// Packets that the host can queue for the OUT endpoint
+#define SEND_QUEUE_LENGTH 4096
+
+// Serial data that has been read from the device but not yet collected
+#define RECEIVE_BUFFER_SIZE 65536
+
+typedef struct
+{
+    uint8_t data[MAX_PACKET_SIZE];
+    uint8_t length;
+} packet;
+
+typedef struct
+{
+    uint16_t size;
+
+    // Zero while the endpoint isn't configured
+    uint8_t banks;
+
+    // Banks holding a packet from the host (OUT) or committed by the firmware (IN).
+    // The firmware accesses bank[0] of an OUT endpoint and bank[filled] of an IN endpoint.
+    packet bank[MAX_BANKS];
+    uint8_t filled;
+
+    // Read or write position in the bank accessed by the firmware
+    uint8_t position;
+} endpoint;
+
+volatile uint8_t USB_DeviceState;
+USB_Request_Header_t USB_ControlRequest;
+
+static endpoint endpoints[MAX_ENDPOINTS];
+static uint8_t selected;
+static uint16_t frame_number;
+
+static packet send_queue[SEND_QUEUE_LENGTH];
+static size_t send_head;
+static size_t send_tail;
+
+static char received[RECEIVE_BUFFER_SIZE];
+static size_t received_length;
+static bool host_reading = true;
+
+static uint8_t status_report[MAX_PACKET_SIZE];
+static uint8_t status_report_length;
+
+// Data stage of the control request being handled
+static uint8_t *control_data;
+static uint16_t control_length;
+static bool control_handled;
+
+static endpoint *current(void)
+{
+    return &endpoints[selected & (MAX_ENDPOINTS - 1)];
+}
+
+void USB_Init(void)
+{
+    USB_DeviceState = DEVICE_STATE_Powered;
+}
+
+void USB_Device_EnableSOFEvents(void)
+{
+    UDIEN |= _BV(SOFE);
+}
+
+uint16_t USB_Device_GetFrameNumber(void)
+{
+    return frame_number;
+}
+
+bool Endpoint_ConfigureEndpoint(uint8_t address, uint8_t type, uint16_t size, uint8_t banks)
+{
+    endpoint *e = &endpoints[address & (MAX_ENDPOINTS - 1)];
+    if (size > MAX_PACKET_SIZE || banks < 1 || banks > MAX_BANKS)
+        return false;
+
+    memset(e, 0, sizeof(endpoint));
+    e->size = size;
+    e->banks = banks;
+    return true;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+    return selected;
+}
+
+void Endpoint_SelectEndpoint(uint8_t address)
+{
+    selected = address;
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+    return current()->filled > 0;
+}
+
+bool Endpoint_IsINReady(void)
+{
+    endpoint *e = current();
+    return e->banks && e->filled < e->banks;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+    endpoint *e = current();
+    return e->filled ? e->bank[0].length - e->position : 0;
+}
+
+uint8_t Endpoint_Read_Stream_LE(void *buffer, uint16_t length, uint16_t *processed)
+{
+    if (length > Endpoint_BytesInEndpoint())
+        return ENDPOINT_RWSTREAM_IncompleteTransfer;
+
+    endpoint *e = current();
+    memcpy(buffer, &e->bank[0].data[e->position], length);
+    e->position += length;
+    return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void *buffer, uint16_t length, uint16_t *processed)
+{
+    endpoint *e = current();
+    if (!Endpoint_IsINReady() || e->position + length > e->size)
+        return ENDPOINT_RWSTREAM_IncompleteTransfer;
+
+    memcpy(&e->bank[e->filled].data[e->position], buffer, length);
+    e->position += length;
+    return ENDPOINT_RWSTREAM_NoError;
+}
+
+// Release the OUT bank so that the host can send the next packet
+void Endpoint_ClearOUT(void)
+{
+    endpoint *e = current();
+    if (!e->filled)
+        return;
+
+    memmove(&e->bank[0], &e->bank[1], sizeof(packet) * (MAX_BANKS - 1));
+    e->filled--;
+    e->position = 0;
+}
+
+// Commit the IN bank to be read by the host
+void Endpoint_ClearIN(void)
+{
+    endpoint *e = current();
+    if (!Endpoint_IsINReady())
+        return;
+
+    e->bank[e->filled].length = e->position;
+    e->filled++;
+    e->position = 0;
+}
+
+void Endpoint_ClearSETUP(void)
+{
+    control_handled = true;
+}
+
+void Endpoint_ClearStatusStage(void) { }
+
+// A stalled request is reported to the host as not handled
+void Endpoint_StallTransaction(void)
+{
+    control_handled = false;
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length)
+{
+    if (length > control_length)
+        length = control_length;
+
+    memcpy(control_data, buffer, length);
+    return ENDPOINT_RWCSTREAM_NoError;
+}
+
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length)
+{
+    if (length > control_length)
+        return ENDPOINT_RWCSTREAM_HostAborted;
+
+    memcpy(buffer, control_data, length);
+    return ENDPOINT_RWCSTREAM_NoError;
+}
+
+bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t *info)
+{
+    const USB_Endpoint_Table_t *tables[] = {
+        &info->Config.DataINEndpoint,
+        &info->Config.DataOUTEndpoint,
+        &info->Config.NotificationEndpoint
+    };
+
+    for (uint8_t i = 0; i < 3; i++)
+        if (!Endpoint_ConfigureEndpoint(tables[i]->Address, tables[i]->Type, tables[i]->Size, tables[i]->Banks))
+            return false;
+
+    return true;
+}
+
+void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t *info)
+{
+    if (USB_ControlRequest.wIndex != info->Config.ControlInterfaceNumber)
+        return;
+
+    switch (USB_ControlRequest.bRequest)
+    {
+        case CDC_REQ_SetLineEncoding:
+            Endpoint_ClearSETUP();
+            Endpoint_Read_Control_Stream_LE(&info->State.LineEncoding, sizeof(CDC_LineEncoding_t));
+            break;
+        case CDC_REQ_GetLineEncoding:
+            Endpoint_ClearSETUP();
+            Endpoint_Write_Control_Stream_LE(&info->State.LineEncoding, sizeof(CDC_LineEncoding_t));
+            break;
+        case CDC_REQ_SetControlLineState:
+            Endpoint_ClearSETUP();
+            info->State.ControlLineStates.HostToDevice = USB_ControlRequest.wValue;
+            EVENT_CDC_Device_ControLineStateChanged(info);
+            break;
+    }
+}
+
+static void control_request(void)
+{
+    EVENT_USB_Device_ControlRequest();
+}
+
+bool sim_usb_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length)
+{
+    USB_ControlRequest = (USB_Request_Header_t) {
+        .bmRequestType = type,
+        .bRequest = request,
+        .wValue = value,
+        .wIndex = index,
+        .wLength = length
+    };
+
+    control_data = data;
+    control_length = length;
+    control_handled = false;
+    sim_interrupt(control_request);
+    return control_handled;
+}
+
+// Configure the device, as the host does after enumerating it, and open the serial
+// port: the host sets the line encoding and raises DTR
+void sim_usb_connect(void)
+{
+    USB_DeviceState = DEVICE_STATE_Configured;
+    sim_interrupt(EVENT_USB_Device_Connect);
+    sim_interrupt(EVENT_USB_Device_ConfigurationChanged);
+
+    CDC_LineEncoding_t encoding = { .BaudRateBPS = 115200, .DataBits = 8 };
+    sim_usb_control(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, CDC_REQ_SetLineEncoding,
+        0, INTERFACE_ID_CDC_CCI, &encoding, sizeof(encoding));
+    sim_usb_control(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, CDC_REQ_SetControlLineState,
+        CDC_CONTROL_LINE_OUT_DTR, INTERFACE_ID_CDC_CCI, NULL, 0);
+}
+
+// Queue serial data to be sent to the device
+void sim_usb_send(const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    while (length > 0 && send_tail - send_head < SEND_QUEUE_LENGTH)
+    {
+        packet *p = &send_queue[send_tail++ % SEND_QUEUE_LENGTH];
+        p->length = length < CDC_TXRX_EPSIZE ? length : CDC_TXRX_EPSIZE;
+        memcpy(p->data, bytes, p->length);
+        bytes += p->length;
+        length -= p->length;
+    }
+}
+
+// Number of packets that the device hasn't accepted yet
+size_t sim_usb_send_pending(void)
+{
+    return send_tail - send_head;
+}
+
+// Collect serial data that has been read from the device
+size_t sim_usb_receive(char *buffer, size_t length)
+{
+    if (length > received_length)
+        length = received_length;
+
+    memcpy(buffer, received, length);
+    received_length -= length;
+    memmove(received, received + length, received_length);
+    return length;
+}
+
+// Stop or resume reading the serial data IN endpoint
+void sim_usb_set_reading(bool reading)
+{
+    host_reading = reading;
+}
+
+bool sim_usb_status_report(void *report, size_t length)
+{
+    if (!status_report_length || length > status_report_length)
+        return false;
+
+    memcpy(report, status_report, length);
+    return true;
+}
+
+// Read the packets from the filled banks of an IN endpoint
+static void host_read(uint8_t address)
+{
+    endpoint *e = &endpoints[address & (MAX_ENDPOINTS - 1)];
+    for (uint8_t i = 0; i < e->filled; i++)
+    {
+        packet *p = &e->bank[i];
+        if (address == STATUS_EPADDR)
+        {
+            memcpy(status_report, p->data, p->length);
+            status_report_length = p->length;
+        }
+        else if (received_length + p->length <= RECEIVE_BUFFER_SIZE)
+        {
+            memcpy(received + received_length, p->data, p->length);
+            received_length += p->length;
+        }
+    }
+
+    e->filled = 0;
+}
+
+// Send queued packets into the free banks of the OUT endpoint
+static void host_write(uint8_t address)
+{
+    endpoint *e = &endpoints[address & (MAX_ENDPOINTS - 1)];
+    while (e->banks && e->filled < e->banks && send_head != send_tail)
+        e->bank[e->filled++] = send_queue[send_head++ % SEND_QUEUE_LENGTH];
+}
+
+ISR(USB_GEN_vect)
+{
+    if (host_reading)
+        host_read(CDC_TX_EPADDR);
+
+    host_read(STATUS_EPADDR);
+    host_write(CDC_RX_EPADDR);
+
+    frame_number = (frame_number + 1) & 0x7FF;
+    EVENT_USB_Device_StartOfFrame();
+}
@@ -0,0 +1,28 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FOCUSER_SIM_USB_H
+#define FOCUSER_SIM_USB_H
+
+// Enumerate the device and open its serial port
+void sim_usb_connect(void);
+
+// Serial data to and from the device
+void sim_usb_send(const void *data, size_t length);
+size_t sim_usb_send_pending(void);
+size_t sim_usb_receive(char *buffer, size_t length);
+void sim_usb_set_reading(bool reading);
+
+// Control requests on the default endpoint.
+// Returns false if the request was stalled by the device.
+bool sim_usb_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length);
+
+// Most recent packet read from the vendor interface status endpoint
+bool sim_usb_status_report(void *report, size_t length);
+
+#endif
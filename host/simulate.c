@@ -0,0 +1,129 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ds18b20.h"
+#include "sim_bus.h"
+
+// Runs the firmware 1-wire engine and DS18B20 driver against the simulated bus.
+// Reports whether the search found every device, the bus time taken by each
+// operation, and how reads behave with injected bit errors and interrupt latency.
+//
+// Usage: simulate [devices] [bit error rate] [max interrupt latency (us)] [reads]
+
+static gpin_t bus = { &PORTF, &PINF, &DDRF, _BV(PF1) };
+
+static double bus_ms(uint64_t start)
+{
+    return (sim_now_ns() - start) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 8;
+    double noise = argc > 2 ? atof(argv[2]) : 0;
+    int latency_us = argc > 3 ? atoi(argv[3]) : 0;
+    int reads = argc > 4 ? atoi(argv[4]) : 1000;
+
+    if (count < 1 || count > SIM_MAX_DEVICES)
+    {
+        fprintf(stderr, "devices must be between 1 and %d\n", SIM_MAX_DEVICES);
+        return 1;
+    }
+
+    srand(1);
+    uint8_t roms[SIM_MAX_DEVICES][8];
+    int16_t temperatures[SIM_MAX_DEVICES];
+    for (int i = 0; i < count; i++)
+    {
+        sim_random_rom(roms[i]);
+        temperatures[i] = (rand() % (60 * 16)) - 20 * 16;
+        sim_add_device(roms[i], temperatures[i]);
+    }
+
+    sim_bus_attach(&bus);
+    ds18b20_initialize(&bus);
+    sim_set_isr_latency(latency_us * 1000);
+
+    // Search for every device without noise
+    onewire_search_state search;
+    ds18b20_search_begin(&search);
+    bool found[SIM_MAX_DEVICES] = {};
+    int found_count = 0, unknown = 0, duplicates = 0;
+    uint64_t start = sim_now_ns();
+    while (ds18b20_start_search(&search))
+    {
+        sim_run_until_idle();
+        if (!ds18b20_finish_search(&search))
+            continue;
+
+        int match = -1;
+        for (int i = 0; i < count; i++)
+            if (!memcmp(roms[i], search.address, 8))
+                match = i;
+
+        if (match < 0)
+            unknown++;
+        else if (found[match])
+            duplicates++;
+        else
+        {
+            found[match] = true;
+            found_count++;
+        }
+    }
+
+    double search_ms = bus_ms(start);
+    printf("search: found %d/%d devices (%d unknown, %d duplicate) in %.2f ms (%.2f ms per device)\n",
+        found_count, count, unknown, duplicates, search_ms, search_ms / count);
+
+    // Convert and poll for completion
+    start = sim_now_ns();
+    ds18b20_start_convert();
+    sim_run_until_idle();
+    double convert_ms = bus_ms(start);
+
+    int polls = 0;
+    do
+    {
+        sim_advance_ns(1000000);
+        ds18b20_start_poll();
+        sim_run_until_idle();
+        polls++;
+    } while (!ds18b20_finish_poll());
+
+    printf("convert: command %.2f ms, complete after %.1f ms (%d polls)\n", convert_ms, bus_ms(start), polls);
+
+    // Read every device repeatedly, with the requested noise and latency
+    sim_set_noise(noise);
+    int ok = 0, failed = 0, wrong = 0;
+    start = sim_now_ns();
+    for (int r = 0; r < reads; r++)
+    {
+        int i = r % count;
+        int16_t reading;
+        uint8_t config[DS18B20_CONFIG_LENGTH];
+        ds18b20_start_read(roms[i]);
+        sim_run_until_idle();
+
+        if (!ds18b20_finish_read(&reading, config))
+            failed++;
+        else if (reading != temperatures[i])
+            wrong++;
+        else
+            ok++;
+    }
+
+    double read_ms = bus_ms(start);
+    printf("read: %d reads in %.2f ms (%.3f ms per read), bit error rate %g, max latency %d us\n",
+        reads, read_ms, read_ms / reads, noise, latency_us);
+    printf("read: %d ok, %d failed (%u CRC failures), %d wrong values accepted, %u injected bit errors\n",
+        ok, failed, ds18b20_crc_failures(), wrong, sim_noise_errors());
+
+    return found_count == count && unknown == 0 && duplicates == 0 ? 0 : 1;
+}
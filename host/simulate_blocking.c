@@ -0,0 +1,157 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ds18b20.h"
+#include "sim_avr.h"
+#include "sim_bus.h"
+
+// Runs the previous blocking DS18B20 driver (host/blocking, from before the
+// Timer3 1-wire engine) against the simulated bus, for comparison with simulate.
+// The same devices are created from the same seed, and the output matches.
+//
+// The blocking driver times its slots with _delay_us busy-waits while interrupts
+// are enabled. The Makefile wraps _delay_us so that the stepping interrupt
+// (every 320 us at full speed) and USB start of frame interrupt (every 1 ms)
+// each stretch any delay that they land in by a random 0 to max latency.
+//
+// Usage: simulate_blocking [devices] [bit error rate] [max interrupt latency (us)] [reads]
+
+#define STEP_INTERVAL_NS 320000
+#define FRAME_INTERVAL_NS 1000000
+
+static gpin_t bus = { &PORTF, &PINF, &DDRF, _BV(PF1) };
+
+static uint64_t latency_ns;
+static uint64_t next_step_ns;
+static uint64_t next_frame_ns;
+
+void __wrap__delay_us(double us)
+{
+    uint64_t now = sim_now_ns();
+    uint64_t end = now + (uint64_t)(us * 1000);
+    while (latency_ns)
+    {
+        while (next_step_ns < now)
+            next_step_ns += STEP_INTERVAL_NS;
+        while (next_frame_ns < now)
+            next_frame_ns += FRAME_INTERVAL_NS;
+
+        // Each interrupt that arrives before the end of the delay extends it
+        uint64_t next = next_step_ns < next_frame_ns ? next_step_ns : next_frame_ns;
+        if (next >= end)
+            break;
+
+        if (next == next_step_ns)
+            next_step_ns += STEP_INTERVAL_NS;
+        else
+            next_frame_ns += FRAME_INTERVAL_NS;
+
+        end += rand() % (latency_ns + 1);
+        now = next;
+    }
+
+    sim_advance_ns(end - sim_now_ns());
+}
+
+// The blocking driver doesn't use Timer3
+void TIMER3_COMPA_vect(void) {}
+
+static double bus_ms(uint64_t start)
+{
+    return (sim_now_ns() - start) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 8;
+    double noise = argc > 2 ? atof(argv[2]) : 0;
+    int latency_us = argc > 3 ? atoi(argv[3]) : 0;
+    int reads = argc > 4 ? atoi(argv[4]) : 1000;
+
+    if (count < 1 || count > SIM_MAX_DEVICES)
+    {
+        fprintf(stderr, "devices must be between 1 and %d\n", SIM_MAX_DEVICES);
+        return 1;
+    }
+
+    srand(1);
+    uint8_t roms[SIM_MAX_DEVICES][8];
+    int16_t temperatures[SIM_MAX_DEVICES];
+    for (int i = 0; i < count; i++)
+    {
+        sim_random_rom(roms[i]);
+        temperatures[i] = (rand() % (60 * 16)) - 20 * 16;
+        sim_add_device(roms[i], temperatures[i]);
+    }
+
+    sim_bus_attach(&bus);
+    latency_ns = latency_us * 1000ULL;
+    next_step_ns = rand() % STEP_INTERVAL_NS;
+    next_frame_ns = rand() % FRAME_INTERVAL_NS;
+
+    // Search for every device without noise
+    uint8_t addresses[SIM_MAX_DEVICES * 8];
+    uint8_t address_count;
+    uint64_t start = sim_now_ns();
+    ds18b20_search(&bus, &address_count, addresses, sizeof(addresses));
+    double search_ms = bus_ms(start);
+
+    int found_count = 0, unknown = 0, duplicates = 0;
+    bool found[SIM_MAX_DEVICES] = {};
+    for (int j = 0; j < address_count; j++)
+    {
+        int match = -1;
+        for (int i = 0; i < count; i++)
+            if (!memcmp(roms[i], &addresses[8 * j], 8))
+                match = i;
+
+        if (match < 0)
+            unknown++;
+        else if (found[match])
+            duplicates++;
+        else
+        {
+            found[match] = true;
+            found_count++;
+        }
+    }
+
+    printf("search: found %d/%d devices (%d unknown, %d duplicate) in %.2f ms (%.2f ms per device)\n",
+        found_count, count, unknown, duplicates, search_ms, search_ms / count);
+
+    // The blocking driver doesn't poll, so wait for the longest conversion
+    start = sim_now_ns();
+    ds18b20_convert(&bus);
+    printf("convert: command %.2f ms\n", bus_ms(start));
+    sim_advance_ns(800000000ULL);
+
+    // Read every device repeatedly, with the requested noise and latency
+    sim_set_noise(noise);
+    int ok = 0, failed = 0, wrong = 0;
+    start = sim_now_ns();
+    for (int r = 0; r < reads; r++)
+    {
+        int i = r % count;
+        int16_t reading;
+        if (!ds18b20_read(&bus, roms[i], &reading))
+            failed++;
+        else if (reading != temperatures[i])
+            wrong++;
+        else
+            ok++;
+    }
+
+    double read_ms = bus_ms(start);
+    printf("read: %d reads in %.2f ms (%.3f ms per read), bit error rate %g, max latency %d us\n",
+        reads, read_ms, read_ms / reads, noise, latency_us);
+    printf("read: %d ok, %d failed, %d wrong values accepted, %u injected bit errors\n",
+        ok, failed, wrong, sim_noise_errors());
+
+    return found_count == count && unknown == 0 && duplicates == 0 ? 0 : 1;
+}
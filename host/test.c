@@ -0,0 +1,43 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+
+static unsigned checks;
+static unsigned failures;
+
+bool test_check(bool ok, const char *expression, const char *file, int line)
+{
+    checks++;
+    if (!ok)
+    {
+        failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    }
+
+    return ok;
+}
+
+bool test_check_string(const char *actual, const char *expected, const char *file, int line)
+{
+    checks++;
+    if (strcmp(actual, expected))
+    {
+        failures++;
+        fprintf(stderr, "%s:%d: expected \"%s\", got \"%s\"\n", file, line, expected, actual);
+        return false;
+    }
+
+    return true;
+}
+
+// Report the result, returning the exit status for main
+int test_finish(const char *name)
+{
+    printf("%s: %u checks, %u failed\n", name, checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+
+#ifndef FOCUSER_TEST_H
+#define FOCUSER_TEST_H
+
+// Assertions for the host tests. A failed check is reported with its location
+// and the test carries on, so that one run shows every failure.
+#define CHECK(condition) test_check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_STRING(actual, expected) test_check_string((actual), (expected), __FILE__, __LINE__)
+
+bool test_check(bool ok, const char *expression, const char *file, int line);
+bool test_check_string(const char *actual, const char *expected, const char *file, int line);
+int test_finish(const char *name);
+
+#endif
@@ -0,0 +1,255 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ds18b20.h"
+#include "sim_bus.h"
+#include "test.h"
+
+// Tests of the 1-wire engine and DS18B20 driver against the simulated bus:
+// address and scratch pad CRCs, the ROM search, conversions and configuration.
+
+#define DEVICE_COUNT 12
+
+static gpin_t bus = { &PORTF, &PINF, &DDRF, _BV(PF1) };
+
+// Address from the 1-wire CRC example in Maxim application note 27, least significant byte first
+static const uint8_t example_rom[8] = { 0x02, 0x1C, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xA2 };
+
+static uint8_t roms[DEVICE_COUNT][8];
+static int16_t temperatures[DEVICE_COUNT];
+
+// Run a complete search, counting the valid addresses that match each device
+// and the addresses that match none. Returns the number of failed search steps.
+static int search(int found[DEVICE_COUNT], int *unknown)
+{
+    memset(found, 0, DEVICE_COUNT * sizeof(int));
+    *unknown = 0;
+    int failures = 0;
+
+    onewire_search_state state;
+    ds18b20_search_begin(&state);
+    while (ds18b20_start_search(&state))
+    {
+        sim_run_until_idle();
+        if (ds18b20_search_failed(&state))
+        {
+            failures++;
+            ds18b20_search_begin(&state);
+            continue;
+        }
+
+        if (!ds18b20_finish_search(&state))
+            continue;
+
+        int match = -1;
+        for (int i = 0; i < DEVICE_COUNT; i++)
+            if (!memcmp(state.address, roms[i], 8))
+                match = i;
+
+        if (match < 0)
+            (*unknown)++;
+        else
+            found[match]++;
+    }
+
+    return failures;
+}
+
+static bool read_device(int i, int16_t *reading, uint8_t config[DS18B20_CONFIG_LENGTH])
+{
+    if (!CHECK(ds18b20_start_read(roms[i])))
+        return false;
+
+    sim_run_until_idle();
+    return ds18b20_finish_read(reading, config);
+}
+
+static void test_empty_bus(void)
+{
+    // No presence pulse ends the search without reporting a failure
+    onewire_search_state state;
+    ds18b20_search_begin(&state);
+    CHECK(ds18b20_start_search(&state));
+    sim_run_until_idle();
+    CHECK(!ds18b20_search_failed(&state));
+    CHECK(!ds18b20_finish_search(&state));
+    CHECK(!ds18b20_start_search(&state));
+
+    CHECK(ds18b20_start_convert());
+    sim_run_until_idle();
+    CHECK(!ds18b20_finish_convert());
+}
+
+static void test_address_crc(void)
+{
+    // The example address has a valid CRC
+    sim_add_device(example_rom, 0);
+    onewire_search_state state;
+    ds18b20_search_begin(&state);
+    CHECK(ds18b20_start_search(&state));
+    sim_run_until_idle();
+    CHECK(!ds18b20_search_failed(&state));
+    CHECK(ds18b20_finish_search(&state));
+    CHECK(!memcmp(state.address, example_rom, 8));
+    CHECK(!ds18b20_start_search(&state));
+
+    // Changing the CRC byte makes the search step fail
+    uint8_t bad_rom[8];
+    memcpy(bad_rom, example_rom, 8);
+    bad_rom[7] ^= 0x01;
+    sim_remove_devices();
+    sim_add_device(bad_rom, 0);
+    ds18b20_search_begin(&state);
+    CHECK(ds18b20_start_search(&state));
+    sim_run_until_idle();
+    CHECK(ds18b20_search_failed(&state));
+    CHECK(!ds18b20_finish_search(&state));
+    sim_remove_devices();
+}
+
+static void test_search(void)
+{
+    int found[DEVICE_COUNT], unknown;
+    CHECK(search(found, &unknown) == 0);
+    CHECK(unknown == 0);
+    for (int i = 0; i < DEVICE_COUNT; i++)
+        CHECK(found[i] == 1);
+}
+
+static void test_search_errors(void)
+{
+    // Bit errors make search steps fail, but never produce an address that isn't on the bus
+    sim_set_noise(0.01);
+    int failures = 0, unknown = 0;
+    for (int r = 0; r < 20; r++)
+    {
+        int found[DEVICE_COUNT], u;
+        failures += search(found, &u);
+        unknown += u;
+    }
+
+    sim_set_noise(0);
+    CHECK(failures > 0);
+    CHECK(unknown == 0);
+}
+
+static void test_convert_and_read(void)
+{
+    CHECK(ds18b20_start_convert());
+    sim_run_until_idle();
+    CHECK(ds18b20_finish_convert());
+
+    // Externally powered devices hold the bus low until the 12-bit conversion completes
+    CHECK(ds18b20_start_poll());
+    sim_run_until_idle();
+    CHECK(!ds18b20_finish_poll());
+
+    sim_advance_ns(ds18b20_conversion_time(12) * 1000000ULL);
+    CHECK(ds18b20_start_poll());
+    sim_run_until_idle();
+    CHECK(ds18b20_finish_poll());
+
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        int16_t reading;
+        uint8_t config[DS18B20_CONFIG_LENGTH];
+        CHECK(read_device(i, &reading, config));
+        CHECK(reading == temperatures[i]);
+        CHECK(ds18b20_resolution(config) == 12);
+    }
+}
+
+static void test_scratchpad_crc(void)
+{
+    // Reads that are corrupted by bit errors fail the CRC check rather than returning a wrong value
+    uint16_t crc_failures = ds18b20_crc_failures();
+    int wrong = 0;
+    sim_set_noise(0.002);
+    for (int r = 0; r < 500; r++)
+    {
+        int i = r % DEVICE_COUNT;
+        int16_t reading;
+        uint8_t config[DS18B20_CONFIG_LENGTH];
+        if (read_device(i, &reading, config) && reading != temperatures[i])
+            wrong++;
+    }
+
+    sim_set_noise(0);
+    CHECK(wrong == 0);
+    CHECK(ds18b20_crc_failures() > crc_failures);
+}
+
+static void test_config(void)
+{
+    // Write 9-bit resolution and an alarm band to the first device
+    uint8_t config[DS18B20_CONFIG_LENGTH];
+    int16_t reading;
+    CHECK(read_device(0, &reading, config));
+    ds18b20_set_resolution(config, 9);
+    ds18b20_set_alarm(config, -10, 40);
+    CHECK(ds18b20_start_write_config(roms[0], config));
+    sim_run_until_idle();
+    CHECK(ds18b20_finish_config());
+
+    uint8_t readback[DS18B20_CONFIG_LENGTH];
+    CHECK(read_device(0, &reading, readback));
+    CHECK(!memcmp(config, readback, DS18B20_CONFIG_LENGTH));
+
+    int8_t low, high;
+    ds18b20_alarm(readback, &low, &high);
+    CHECK(low == -10 && high == 40);
+
+    // The low bits of a 9-bit reading are undefined, so are cleared
+    CHECK(ds18b20_start_convert());
+    sim_run_until_idle();
+    sim_advance_ns(ds18b20_conversion_time(12) * 1000000ULL);
+    CHECK(read_device(0, &reading, readback));
+    CHECK(reading == (temperatures[0] & ~0x07));
+}
+
+static void test_power_supply(void)
+{
+    bool parasite = true;
+    CHECK(ds18b20_start_read_power());
+    sim_run_until_idle();
+    CHECK(ds18b20_finish_read_power(&parasite));
+    CHECK(!parasite);
+
+    sim_set_parasite(DEVICE_COUNT - 1, true);
+    CHECK(ds18b20_start_read_power());
+    sim_run_until_idle();
+    CHECK(ds18b20_finish_read_power(&parasite));
+    CHECK(parasite);
+    sim_set_parasite(DEVICE_COUNT - 1, false);
+}
+
+int main(void)
+{
+    srand(1);
+    sim_bus_attach(&bus);
+    ds18b20_initialize(&bus);
+
+    test_empty_bus();
+    test_address_crc();
+
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        sim_random_rom(roms[i]);
+        temperatures[i] = (rand() % (60 * 16)) - 20 * 16;
+        sim_add_device(roms[i], temperatures[i]);
+    }
+
+    test_search();
+    test_search_errors();
+    test_convert_and_read();
+    test_scratchpad_crc();
+    test_config();
+    test_power_supply();
+
+    return test_finish("test_ds18b20");
+}
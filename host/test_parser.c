@@ -0,0 +1,817 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "config.h"
+#include "gpio.h"
+#include "history.h"
+#include "sim_avr.h"
+#include "sim_bus.h"
+#include "sim_firmware.h"
+#include "sim_usb.h"
+#include "test.h"
+#include "usb.h"
+#include "usb_descriptors.h"
+
+// Tests of the serial command parser and the vendor interface, run against the
+// complete firmware through the emulated USB endpoints.
+
+// The Makefile renames the firmware main() to firmware_main
+#undef main
+
+// Time allowed for the device to start answering a command (e.g. W writes
+// the EEPROM first), and then to finish streaming its response
+#define RESPONSE_TIMEOUT_MS 1000
+#define RESPONSE_MS 20
+
+#define PROBE_COUNT 2
+
+static uint8_t roms[PROBE_COUNT][8];
+
+// A device from another 1-wire family (DS18S20) that shares the bus
+static uint8_t other_rom[8];
+static int devices[PROBE_COUNT];
+
+// Layout of the saved settings, as in config.c
+#define CONFIG_EEPROM_ADDRESS 0x80
+
+typedef struct
+{
+    uint8_t version;
+    uint16_t crc;
+    config_data data;
+} config_block;
+static char response[4096];
+static size_t response_length;
+
+// Unsolicited event lines (starting with '*') received since the last clear_events
+static char events[4096];
+static size_t events_length;
+
+static void append(char *buffer, size_t *length, size_t size, const char *line, size_t line_length)
+{
+    if (*length + line_length >= size)
+        return;
+
+    memcpy(buffer + *length, line, line_length);
+    *length += line_length;
+    buffer[*length] = '\0';
+}
+
+// Append the serial output to the response, moving the event lines to events
+static void receive(void)
+{
+    char buffer[sizeof(response)];
+    size_t length = sim_usb_receive(buffer, sizeof(buffer) - 1);
+    buffer[length] = '\0';
+
+    for (char *line = buffer; *line; )
+    {
+        char *end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        size_t line_length = end - line;
+        if (line[0] == '*')
+            append(events, &events_length, sizeof(events), line, line_length);
+        else
+            append(response, &response_length, sizeof(response), line, line_length);
+
+        line = end;
+    }
+}
+
+static void clear_events(void)
+{
+    events[0] = '\0';
+    events_length = 0;
+}
+
+// Return the output since the last command
+static const char *receive_all(void)
+{
+    response[0] = '\0';
+    response_length = 0;
+    receive();
+    return response;
+}
+
+// Send a command line and return the device's response
+static const char *command(const char *line)
+{
+    char buffer[256];
+    size_t length = snprintf(buffer, sizeof(buffer), "%s\n", line);
+    receive_all();
+    sim_usb_send(buffer, length);
+
+    for (uint32_t ms = 0; ms < RESPONSE_TIMEOUT_MS && !response_length; ms += RESPONSE_MS)
+    {
+        sim_firmware_run_ms(RESPONSE_MS);
+        receive();
+    }
+
+    // Let a streamed response finish
+    sim_firmware_run_ms(RESPONSE_MS);
+    receive();
+    return response;
+}
+
+// Check that the response to a command starts with the expected text
+static bool check_prefix(const char *line, const char *expected, const char *file, int line_number)
+{
+    const char *actual = command(line);
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)strlen(expected), actual);
+    return test_check_string(prefix, expected, file, line_number);
+}
+
+#define CHECK_COMMAND(line, expected) CHECK_STRING(command(line), (expected))
+#define CHECK_COMMAND_PREFIX(line, expected) check_prefix((line), (expected), __FILE__, __LINE__)
+
+static uint32_t device_time(void)
+{
+    return strtoul(command("T") + 2, NULL, 10);
+}
+
+static void test_status(void)
+{
+    CHECK_COMMAND("1Z", "$\r\n");
+    const char *status = command("?");
+    uint32_t time;
+#if CHANNELS == 2
+    CHECK_COMMAND("2Z", "$\r\n");
+    status = command("?");
+    CHECK(sscanf(status, "T1=+000000,C1=+000000,T2=+000000,C2=+000000,T=%" SCNu32 "\r\n", &time) == 1);
+#else
+    CHECK(sscanf(status, "T1=+000000,C1=+000000,T=%" SCNu32 "\r\n", &time) == 1);
+#endif
+    CHECK(time > 0);
+
+    uint32_t ms;
+    unsigned us, frame;
+    CHECK(sscanf(command("T"), "T=%" SCNu32 ".%u,F=%u\r\n", &ms, &us, &frame) == 3);
+    CHECK(ms >= time && us < 1000 && frame < 2048);
+
+    // The stepping interrupt is held off by at most the 70 us presence sample
+    // of a 1-wire reset, and not by the device clock locking to the USB frames
+    unsigned latency;
+    CHECK(sscanf(strstr(command("!"), ",M="), ",M=%u\r\n", &latency) == 1);
+    CHECK(latency <= 80);
+}
+
+static void test_move(void)
+{
+    CHECK_COMMAND("1+100", "$\r\n");
+    CHECK_COMMAND_PREFIX("?", "T1=+000100,");
+    sim_firmware_run_ms(2000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000100,C1=+000100,");
+
+    CHECK_COMMAND("1-0000010", "$\r\n");
+    CHECK_COMMAND_PREFIX("?", "T1=-000010,");
+    CHECK_COMMAND("1S", "$\r\n");
+
+    // Malformed positions are rejected without moving
+    CHECK_COMMAND("1+12345678", "?\r\n");
+    CHECK_COMMAND("1+1x", "?\r\n");
+    CHECK_COMMAND("1+10@", "?\r\n");
+    CHECK_COMMAND("1+10@12345678901", "?\r\n");
+    CHECK_COMMAND("1+10@1x", "?\r\n");
+    CHECK_COMMAND("3+10", "?\r\n");
+    sim_firmware_run_ms(1000);
+    int32_t target, current;
+    CHECK(sscanf(command("?"), "T1=%" SCNd32 ",C1=%" SCNd32, &target, &current) == 2);
+    CHECK(target == current && current > -10 && current < 100);
+    CHECK_COMMAND("1Z", "$\r\n");
+    CHECK_COMMAND_PREFIX("?", "T1=+000000,C1=+000000,");
+}
+
+static void test_scheduled_move(void)
+{
+    char line[32];
+    sprintf(line, "1+20@%" PRIu32, device_time() + 500);
+    CHECK_COMMAND(line, "$\r\n");
+    sim_firmware_run_ms(400);
+    CHECK_COMMAND_PREFIX("?", "T1=+000000,C1=+000000,");
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000020,C1=+000020,");
+}
+
+static void test_fans(void)
+{
+    CHECK_COMMAND("#", "0\r\n");
+    CHECK_COMMAND("#1", "$\r\n");
+    CHECK_COMMAND("#", "1\r\n");
+    CHECK_COMMAND("#2", "?\r\n");
+    CHECK_COMMAND("#0", "$\r\n");
+    CHECK_COMMAND("#", "0\r\n");
+}
+
+static void test_compensation(void)
+{
+    CHECK_COMMAND("1K2,+10.5,-3.25,0.25", "$\r\n");
+    CHECK_COMMAND_PREFIX("1K", "P=2,R=+10.5000,C=-3.2500,D=0.2500,");
+    CHECK_COMMAND("1K256", "?\r\n");
+    CHECK_COMMAND("1K2,10.5,-3.25", "?\r\n");
+    CHECK_COMMAND("1K2,10.5,-3.25,0.25x", "?\r\n");
+    CHECK_COMMAND("1K2,1000,-3.25,0.25", "?\r\n");
+    CHECK_COMMAND_PREFIX("1K", "P=2,R=+10.5000,C=-3.2500,D=0.2500,");
+    CHECK_COMMAND("1K0", "$\r\n");
+    CHECK_COMMAND_PREFIX("1K", "P=0,");
+}
+
+static void test_probes(void)
+{
+    // Each probe is listed once with its address
+    const char *list = command("@");
+    CHECK(strncmp(list, "1=", 2) == 0);
+    for (uint8_t i = 0; i < PROBE_COUNT; i++)
+    {
+        char address[17];
+        for (uint8_t j = 0; j < 8; j++)
+            sprintf(address + 2 * j, "%02X", roms[i][j]);
+        CHECK(strstr(list, address) != NULL);
+    }
+
+    // Other devices are ignored, and counted in the diagnostics
+    char address[17];
+    for (uint8_t j = 0; j < 8; j++)
+        sprintf(address + 2 * j, "%02X", other_rom[j]);
+    CHECK(strstr(list, address) == NULL);
+    CHECK_COMMAND_PREFIX("!", "O=0,C=0,P=1,");
+
+    CHECK_COMMAND_PREFIX("@*", "1=");
+
+    char line[20];
+    sprintf(line, "@%02X%02X%02X%02X%02X%02X%02X%02X", roms[0][0], roms[0][1], roms[0][2],
+        roms[0][3], roms[0][4], roms[0][5], roms[0][6], roms[0][7]);
+    const char *reading = command(line);
+    CHECK(strchr(reading, ',') && strstr(reading, ",T=") && strcmp(reading, "FAILED\r\n"));
+
+    CHECK_COMMAND("@9", "FAILED\r\n");
+    CHECK_COMMAND("@123", "?\r\n");
+    CHECK_COMMAND("@1x", "?\r\n");
+
+    CHECK_COMMAND("@1:10,30", "$\r\n");
+    CHECK_COMMAND("@1:", "L=+10,H=+30\r\n");
+    CHECK_COMMAND("@1:30,10", "?\r\n");
+    CHECK_COMMAND("@1:10", "?\r\n");
+    CHECK_COMMAND("@1:-200,10", "?\r\n");
+    CHECK_COMMAND("@1:", "L=+10,H=+30\r\n");
+
+    CHECK_COMMAND("@1=9", "$\r\n");
+    CHECK_COMMAND("@1=x", "?\r\n");
+    CHECK_COMMAND("@1=12", "$\r\n");
+
+    CHECK_COMMAND("@A", "0\r\n");
+    CHECK_COMMAND("@A1", "$\r\n");
+    CHECK_COMMAND("@A", "1\r\n");
+    CHECK_COMMAND("@A2", "?\r\n");
+    CHECK_COMMAND("@A0", "$\r\n");
+}
+
+// Returns the index of the probe with the given address
+static int probe_index(const uint8_t rom[8])
+{
+    char address[18];
+    address[0] = '=';
+    for (uint8_t j = 0; j < 8; j++)
+        sprintf(address + 1 + 2 * j, "%02X", rom[j]);
+
+    const char *list = command("@");
+    const char *match = strstr(list, address);
+    if (!match || match == list)
+        return 0;
+
+    // Indices have one or two digits
+    while (match > list && match[-1] != ',')
+        match--;
+
+    return atoi(match);
+}
+
+static void test_alarm(void)
+{
+    // Probe a is below its alarm band and probe b is inside it
+    int a = probe_index(roms[0]);
+    int b = probe_index(roms[1]);
+    CHECK(a && b && a != b);
+
+    char line[64], expected[64];
+    sprintf(line, "@%d:25,30", a);
+    CHECK_COMMAND(line, "$\r\n");
+    sprintf(line, "@%d:10,30", b);
+    CHECK_COMMAND(line, "$\r\n");
+    sim_firmware_run_ms(3000);
+
+    // Only the probe that responds to the alarm search is read and reported
+    CHECK_COMMAND("@A1", "$\r\n");
+    sim_firmware_run_ms(2000);
+    clear_events();
+    sim_set_temperature(devices[0], 21 * 16);
+    sim_set_temperature(devices[1], 22 * 16);
+    sim_firmware_run_ms(4100);
+    receive();
+
+    sprintf(expected, "*A%d=21.0000,T=", a);
+    CHECK(strstr(events, expected) != NULL);
+    sprintf(expected, "*A%d=", b);
+    CHECK(strstr(events, expected) == NULL);
+
+    sprintf(line, "@%d", a);
+    CHECK_COMMAND_PREFIX(line, "21.0000,T=");
+    sprintf(line, "@%d", b);
+    CHECK_COMMAND_PREFIX(line, "20.0625,T=");
+
+    // A probe that is used for temperature compensation is read after every
+    // conversion, but still only reported while it is outside its band
+    sprintf(line, "1K%d,+20,0,0.25", b);
+    CHECK_COMMAND(line, "$\r\n");
+    clear_events();
+    sim_firmware_run_ms(4100);
+    receive();
+
+    sprintf(line, "@%d", b);
+    CHECK_COMMAND_PREFIX(line, "22.0000,T=");
+    sprintf(expected, "*A%d=", b);
+    CHECK(strstr(events, expected) == NULL);
+
+    CHECK_COMMAND("1K0", "$\r\n");
+    CHECK_COMMAND("@A0", "$\r\n");
+    for (uint8_t i = 0; i < PROBE_COUNT; i++)
+        sim_set_temperature(devices[i], 20 * 16 + i);
+    sim_firmware_run_ms(2000);
+}
+
+// Run until the readings from the next conversion have been published
+static bool wait_for_conversion(void)
+{
+    uint32_t time = temperature_sweep_time();
+    for (uint32_t ms = 0; ms < 4000; ms += 10)
+    {
+        sim_firmware_run_ms(10);
+        if (temperature_sweep_time() != time)
+            return true;
+    }
+
+    return false;
+}
+
+// Run until the history holds the samples before the given sequence number
+static bool wait_for_sample(uint32_t sequence)
+{
+    for (uint8_t i = 0; i <= HISTORY_DECIMATION; i++)
+    {
+        if (history_next_sequence() >= sequence)
+            return true;
+
+        wait_for_conversion();
+    }
+
+    return false;
+}
+
+// Returns the line of a H response for a probe index
+static const char *find_line(const char *response, int index)
+{
+    static char line[128];
+    char prefix[8];
+    sprintf(prefix, "%d,N=", index);
+
+    line[0] = '\0';
+    for (const char *l = response; l; l = strchr(l, '\n'), l = l ? l + 1 : NULL)
+    {
+        if (strncmp(l, prefix, strlen(prefix)) == 0)
+        {
+            snprintf(line, sizeof(line), "%.*s", (int)strcspn(l, "\r"), l);
+            break;
+        }
+    }
+
+    return line;
+}
+
+static void test_history(void)
+{
+    // The statistics end with the sequence number of the next sample
+    const char *stats = command("H");
+    CHECK(strncmp(stats, "1,N=", 4) == 0);
+    const char *sequence = strstr(stats, "S=");
+    CHECK(sequence && strchr(sequence, '\n')[1] == '\0');
+
+    CHECK_COMMAND_PREFIX("H0", "0,T=");
+    CHECK_COMMAND("Hx", "?\r\n");
+    CHECK_COMMAND("H1x", "?\r\n");
+
+    // The statistics cover the readings since the previous H
+    int a = probe_index(roms[0]);
+    char line[64], expected[128];
+    CHECK(wait_for_conversion());
+    command("H");
+
+    const int16_t readings[] = { 20 * 16, 21 * 16 + 4, 19 * 16 + 8, 22 * 16 + 12 };
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        sim_set_temperature(devices[0], readings[i]);
+        CHECK(wait_for_conversion());
+    }
+
+    sprintf(expected, "%d,N=4,L=19.5000,H=22.7500,M=20.8750,R=", a);
+    sprintf(line, "%.*s", (int)strlen(expected), find_line(command("H"), a));
+    CHECK_STRING(line, expected);
+    CHECK_COMMAND_PREFIX("H", "S=");
+
+    // The rate of change is fitted over the whole history, so a ramp of
+    // 1/16 C per conversion (every 2 s) that fills it gives 1.875 C per minute
+    for (uint16_t i = 0; i < (HISTORY_LENGTH + 1) * HISTORY_DECIMATION; i++)
+    {
+        sim_set_temperature(devices[0], 20 * 16 + i);
+        CHECK(wait_for_conversion());
+    }
+
+    const char *rate = strstr(find_line(command("H"), a), ",R=");
+    CHECK_STRING(rate, ",R=+1.8750");
+
+    // Each sample is the mean of a block of conversions, and H[seq] only
+    // returns the samples from that sequence number onwards
+    sim_set_temperature(devices[0], 25 * 16 + 8);
+    uint32_t seq = history_next_sequence();
+    CHECK(wait_for_sample(seq + 1));
+    seq++;
+    CHECK(wait_for_sample(seq + 1));
+
+    sprintf(line, "H%" PRIu32, seq);
+    const char *samples = command(line);
+    sprintf(expected, "%" PRIu32 ",T=", seq);
+    CHECK(strncmp(samples, expected, strlen(expected)) == 0);
+    sprintf(expected, ",%d=25.5000", a);
+    CHECK(strstr(samples, expected) != NULL);
+    sprintf(expected, "\r\nS=%" PRIu32 "\r\n", seq + 1);
+    CHECK(strstr(samples, expected) != NULL && strchr(samples, '\n') + 1 == strstr(samples, "S="));
+
+    sprintf(line, "H%" PRIu32, seq + 1);
+    sprintf(expected, "S=%" PRIu32 "\r\n", seq + 1);
+    CHECK_COMMAND(line, expected);
+
+    sim_set_temperature(devices[0], 20 * 16);
+}
+
+static unsigned tx_overflows(void)
+{
+    return strtoul(command("!") + 2, NULL, 10);
+}
+
+static void test_streaming(void)
+{
+    // A response longer than the send buffer is written as the host makes space
+    char expected[sizeof(response)];
+    strcpy(expected, command("H0"));
+    CHECK(strlen(expected) > 128);
+    unsigned overflows = tx_overflows();
+
+    receive_all();
+    sim_usb_set_reading(false);
+    sim_usb_send("H0\n", 3);
+
+    // The main loop keeps running while it waits for the host
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        uint64_t start = sim_now_ns();
+        sim_firmware_run_ms(1);
+        CHECK(sim_now_ns() - start < 1100000);
+    }
+
+    sim_usb_set_reading(true);
+    sim_firmware_run_ms(RESPONSE_MS);
+    receive();
+    CHECK_STRING(response, expected);
+    CHECK(tx_overflows() == overflows);
+
+    // Commands received during a streamed response are handled after it
+    receive_all();
+    sim_usb_set_reading(false);
+    sim_usb_send("H0\nX\n", 5);
+    sim_firmware_run_ms(8);
+    sim_usb_set_reading(true);
+    sim_firmware_run_ms(RESPONSE_MS);
+    receive();
+    strcat(expected, "?\r\n");
+    CHECK_STRING(response, expected);
+
+    // The rest of the response is dropped if the host stops reading, while
+    // the main loop keeps updating the temperatures
+    uint32_t sweep = temperature_sweep_time();
+    receive_all();
+    sim_usb_set_reading(false);
+    sim_usb_send("H0\n", 3);
+    sim_firmware_run_ms(3000);
+    sim_usb_set_reading(true);
+    sim_firmware_run_ms(RESPONSE_MS);
+    receive();
+    CHECK(response_length > 0 && response_length < strlen(expected));
+    CHECK(temperature_sweep_time() != sweep);
+    CHECK(tx_overflows() == overflows + 1);
+    CHECK_COMMAND("X", "?\r\n");
+}
+
+static void test_unknown(void)
+{
+    CHECK_COMMAND("X", "?\r\n");
+    CHECK_COMMAND("?1", "?\r\n");
+    CHECK_COMMAND("W", "$\r\n");
+    CHECK_COMMAND_PREFIX("!", "O=0,C=0,");
+}
+
+static void test_config(void)
+{
+    // Settings are saved by W and loaded back from the EEPROM
+    CHECK_COMMAND("1K2,+10.5,-3.25,0.25", "$\r\n");
+    CHECK_COMMAND("@A1", "$\r\n");
+    CHECK_COMMAND("W", "$\r\n");
+
+    config_data saved = *config_get();
+    CHECK(saved.compensation[0].probe == 2 && saved.alarm_mode);
+    config_initialize();
+    CHECK(!memcmp(config_get(), &saved, sizeof(config_data)));
+
+    // Saving unchanged settings doesn't write the EEPROM
+    uint32_t writes = sim_eeprom_writes();
+    CHECK_COMMAND("W", "$\r\n");
+    CHECK(sim_eeprom_writes() == writes);
+
+    // A change to the version or any byte covered by the CRC restores the defaults
+    config_data defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    uint16_t offsets[sizeof(config_data) + 1];
+    offsets[0] = offsetof(config_block, version);
+    for (uint8_t j = 0; j < sizeof(config_data); j++)
+        offsets[j + 1] = offsetof(config_block, data) + j;
+
+    for (uint8_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++)
+    {
+        uint16_t address = CONFIG_EEPROM_ADDRESS + offsets[j];
+        uint8_t original, corrupted;
+        sim_eeprom_read(address, &original, 1);
+        corrupted = original ^ 0x04;
+        sim_eeprom_write(address, &corrupted, 1);
+        config_initialize();
+        CHECK(!memcmp(config_get(), &defaults, sizeof(config_data)));
+
+        sim_eeprom_write(address, &original, 1);
+        config_initialize();
+        CHECK(!memcmp(config_get(), &saved, sizeof(config_data)));
+    }
+
+    CHECK_COMMAND("1K0", "$\r\n");
+    CHECK_COMMAND("@A0", "$\r\n");
+    CHECK_COMMAND("W", "$\r\n");
+}
+
+// Number of response lines received since the last command
+static size_t response_lines(void)
+{
+    receive();
+    size_t lines = 0;
+    for (const char *c = response; *c; c++)
+        if (*c == '\n')
+            lines++;
+
+    return lines;
+}
+
+static void test_latency(void)
+{
+    // A command is copied from the OUT endpoint at the next start of frame and
+    // parsed straight away, and its response is sent at the following one, so
+    // the host has it at most three frames after sending the command
+    uint64_t worst_ns = 0;
+    for (uint32_t i = 0; i < 50; i++)
+    {
+        sim_firmware_run_until(sim_now_ns() + i * 20000);
+        receive_all();
+        uint64_t start = sim_now_ns();
+        sim_usb_send("?\n", 2);
+        while (response_lines() == 0 && sim_now_ns() - start < 10000000)
+            sim_firmware_run_until(sim_now_ns() + 10000);
+
+        if (sim_now_ns() - start > worst_ns)
+            worst_ns = sim_now_ns() - start;
+    }
+
+    CHECK(worst_ns <= 3100000);
+}
+
+static void test_throughput(void)
+{
+    // With two "?" commands in flight their responses share the send queue,
+    // so the host gets two responses every three frames
+    unsigned overflows = tx_overflows();
+    receive_all();
+    uint32_t sent = 0;
+    uint64_t start = sim_now_ns();
+    while (response_lines() < 50 && sim_now_ns() - start < 1000000000)
+    {
+        for (; sent < 50 && sent < response_lines() + 2; sent++)
+            sim_usb_send("?\n", 2);
+
+        sim_firmware_run_until(sim_now_ns() + 10000);
+    }
+
+    CHECK(response_lines() == 50);
+    CHECK(sim_now_ns() - start <= 80000000);
+    CHECK(tx_overflows() == overflows);
+
+    // A streamed response is sent in both 64 byte banks of the IN endpoint,
+    // so it arrives at more than one packet per frame
+    receive_all();
+    sim_usb_send("H0\n", 3);
+    while (response_length == 0)
+    {
+        sim_firmware_run_until(sim_now_ns() + 10000);
+        receive();
+    }
+
+    size_t first = response_length;
+    start = sim_now_ns();
+    while (!strstr(response, "S=") && sim_now_ns() - start < 1000000000)
+    {
+        sim_firmware_run_until(sim_now_ns() + 10000);
+        receive();
+    }
+
+    uint64_t frames = (sim_now_ns() - start + 999999) / 1000000;
+    CHECK(response_length - first > 64 * frames);
+}
+
+static void test_long_lines(void)
+{
+    // A long unterminated line must not stop the following full
+    // packet being accepted, and is answered once it ends
+    char line[128];
+    memset(line, 'x', 100);
+    sim_usb_send(line, 100);
+    sim_firmware_run_ms(RESPONSE_MS);
+    line[CDC_TXRX_EPSIZE - 1] = '\n';
+    sim_usb_send(line, CDC_TXRX_EPSIZE);
+    CHECK_COMMAND_PREFIX("?", "?\r\nT1=");
+    CHECK(sim_usb_send_pending() == 0);
+
+    // The longest line is accepted, and a longer line rejected, wherever it falls in
+    // the receive buffer. Each pass shifts the following lines by one byte.
+    strcpy(line, "1K2,+10.5,-3.25,0.25");
+    memset(line + 20, '0', 43);
+    line[63] = '\0';
+    for (uint8_t i = 0; i < 64; i++)
+    {
+        CHECK_COMMAND(line, "$\r\n");
+        strcat(line, "0");
+        CHECK_COMMAND(line, "?\r\n");
+        line[63] = '\0';
+        sim_usb_send("\n", 1);
+    }
+
+    CHECK_COMMAND_PREFIX("1K", "P=2,R=+10.5000,C=-3.2500,D=0.2500,");
+    CHECK_COMMAND("1K0", "$\r\n");
+}
+
+static void test_priority_stop(void)
+{
+    // A stop discards the moves for its channel that were received before it,
+    // even if the command loop is held up by a settings save between them
+    CHECK_COMMAND("1Z", "$\r\n");
+    CHECK_COMMAND("1K2,+10.5,-3.25,0.25", "$\r\n");
+    CHECK_COMMAND("1+500\nW\n1S", "$\r\n$\r\n$\r\n");
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000000,C1=+000000,");
+    CHECK_COMMAND("1K0", "$\r\n");
+    CHECK_COMMAND("W", "$\r\n");
+
+    char line[32];
+    sprintf(line, "1+20@%" PRIu32 "\n1S", device_time() + 100);
+    CHECK_COMMAND(line, "$\r\n$\r\n");
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000000,C1=+000000,");
+
+    // Moves received after the stop are applied
+    CHECK_COMMAND("1+500\n1S\n1+10", "$\r\n$\r\n$\r\n");
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000010,C1=+000010,");
+
+#if CHANNELS == 2
+    // Other channels are not affected
+    CHECK_COMMAND("2Z", "$\r\n");
+    CHECK_COMMAND("2+10\n1S", "$\r\n$\r\n");
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000010,C1=+000010,T2=+000010,C2=+000010,");
+#endif
+}
+
+static bool vendor_request(bool in, uint8_t request, uint16_t value, void *data, uint16_t length)
+{
+    uint8_t type = (in ? REQDIR_DEVICETOHOST : REQDIR_HOSTTODEVICE) | REQTYPE_VENDOR | REQREC_INTERFACE;
+    return sim_usb_control(type, request, value, INTERFACE_ID_Vendor, data, length);
+}
+
+static void test_vendor(void)
+{
+    int32_t target = 30;
+    CHECK(vendor_request(false, USB_VENDOR_REQUEST_SET_TARGET, 0, &target, sizeof(target)));
+    CHECK(!vendor_request(false, USB_VENDOR_REQUEST_SET_TARGET, CHANNEL_COUNT, &target, sizeof(target)));
+
+    usb_vendor_status status;
+    CHECK(vendor_request(true, USB_VENDOR_REQUEST_GET_STATUS, 0, &status, sizeof(status)));
+    CHECK(status.channel_count == CHANNEL_COUNT);
+    CHECK(status.channels[0].target == 30);
+
+    // Targets beyond 7 digits are stalled and leave the target unchanged
+    int32_t limits[] = { 9999999, -9999999 };
+    int32_t invalid[] = { 10000000, -10000000, INT32_MAX, INT32_MIN };
+    for (uint8_t j = 0; j < 2; j++)
+    {
+        CHECK(vendor_request(false, USB_VENDOR_REQUEST_SET_TARGET, 0, &limits[j], sizeof(int32_t)));
+        CHECK(vendor_request(true, USB_VENDOR_REQUEST_GET_STATUS, 0, &status, sizeof(status)));
+        CHECK(status.channels[0].target == limits[j]);
+    }
+
+    CHECK(vendor_request(false, USB_VENDOR_REQUEST_SET_TARGET, 0, &target, sizeof(target)));
+    for (uint8_t j = 0; j < 4; j++)
+    {
+        usb_vendor_schedule invalid_schedule = { invalid[j], device_time() + 200 };
+        CHECK(!vendor_request(false, USB_VENDOR_REQUEST_SET_TARGET, 0, &invalid[j], sizeof(int32_t)));
+        CHECK(!vendor_request(false, USB_VENDOR_REQUEST_SCHEDULE_TARGET, 0, &invalid_schedule, sizeof(invalid_schedule)));
+    }
+
+    CHECK(vendor_request(true, USB_VENDOR_REQUEST_GET_STATUS, 0, &status, sizeof(status)));
+    CHECK(status.channels[0].target == 30);
+
+    sim_firmware_run_ms(1000);
+    usb_status_report report;
+    CHECK(sim_usb_status_report(&report, sizeof(report)));
+    CHECK(report.channels[0].target == 30 && report.channels[0].current == 30);
+    CHECK(!(report.flags & 0x01));
+
+    usb_vendor_schedule schedule = { 40, device_time() + 200 };
+    CHECK(vendor_request(false, USB_VENDOR_REQUEST_SCHEDULE_TARGET, 0, &schedule, sizeof(schedule)));
+    sim_firmware_run_ms(1000);
+    CHECK_COMMAND_PREFIX("?", "T1=+000040,C1=+000040,");
+
+    CHECK(vendor_request(false, USB_VENDOR_REQUEST_STOP, 0, NULL, 0));
+
+    // A stop request discards moves that have been received but not parsed.
+    // Running the interrupts without the main loop delivers the packet.
+    sim_usb_send("1+100\n", 6);
+    sim_run_until(sim_now_ns() + 2 * RESPONSE_MS * 1000000ULL);
+    CHECK(sim_usb_send_pending() == 0);
+    CHECK(vendor_request(false, USB_VENDOR_REQUEST_STOP, 0, NULL, 0));
+    sim_firmware_run_ms(1000);
+    CHECK_STRING(receive_all(), "$\r\n");
+    CHECK_COMMAND_PREFIX("?", "T1=+000040,C1=+000040,");
+    CHECK(!vendor_request(false, 0xFF, 0, NULL, 0));
+}
+
+int main(void)
+{
+    srand(1);
+    for (uint8_t i = 0; i < PROBE_COUNT; i++)
+    {
+        sim_random_rom(roms[i]);
+        devices[i] = sim_add_device(roms[i], 20 * 16 + i);
+    }
+
+    sim_random_rom(other_rom);
+    other_rom[0] = 0x10;
+    other_rom[7] = 0;
+    for (uint8_t i = 0; i < 7; i++)
+        other_rom[7] = _crc_ibutton_update(other_rom[7], other_rom[i]);
+    sim_add_device(other_rom, 0);
+
+    sim_firmware_start();
+    sim_usb_connect();
+
+    // Wait for the probes to be found and read
+    sim_firmware_run_ms(3000);
+
+    test_status();
+    test_move();
+    test_scheduled_move();
+    test_fans();
+    test_compensation();
+    test_probes();
+    test_alarm();
+    test_history();
+    test_unknown();
+    test_config();
+    test_latency();
+    test_throughput();
+    test_long_lines();
+    test_priority_stop();
+    test_vendor();
+    test_streaming();
+
+    return test_finish("test_parser");
+}
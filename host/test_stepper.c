@@ -0,0 +1,502 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+#include <util/crc16.h>
+#include "clock.h"
+#include "gpio.h"
+#include "journal.h"
+#include "sim_avr.h"
+#include "sim_firmware.h"
+#include "stepper.h"
+#include "test.h"
+
+// Tests of the step and direction sequences generated by the stepping ISR.
+// The build wraps the ISR (-Wl,--wrap=TIMER1_COMPA_vect) so that the pins of
+// every channel can be sampled before and after each interrupt.
+// The position journal is tested by writing records directly to the
+// simulated EEPROM, in the same layout as journal.c.
+
+// The Makefile renames the firmware main() to firmware_main
+#undef main
+
+#define STEPS_PER_POSITION 16
+
+#define JOURNAL_EEPROM_ADDRESS 0x180
+
+typedef struct
+{
+    uint16_t sequence;
+    journal_channel channels[CHANNEL_COUNT];
+    uint8_t crc;
+} journal_record;
+
+#define JOURNAL_RECORDS ((E2END + 1 - JOURNAL_EEPROM_ADDRESS) / sizeof(journal_record))
+
+extern int32_t current_steps[CHANNEL_COUNT];
+
+typedef struct
+{
+    gpin_t enable;
+    gpin_t step;
+    gpin_t dir;
+} pins;
+
+static const pins channel_pins[CHANNEL_COUNT] = {
+    {
+        { &PORTD, &PIND, &DDRD, _BV(PD1) },
+        { &PORTB, &PINB, &DDRB, _BV(PB2) },
+        { &PORTB, &PINB, &DDRB, _BV(PB1) }
+    },
+#if CHANNELS == 2
+    {
+        { &PORTB, &PINB, &DDRB, _BV(PB6) },
+        { &PORTD, &PIND, &DDRD, _BV(PD4) },
+        { &PORTD, &PIND, &DDRD, _BV(PD0) }
+    }
+#endif
+};
+
+typedef struct
+{
+    bool enabled;
+    bool step;
+    bool dir;
+} pin_state;
+
+typedef struct
+{
+    // Steps counted from the rising edges, signed by the direction pin
+    int32_t steps;
+
+    // Rising edges that enable the motor, which aren't counted.
+    // The step pin is left high if the previous move ended on a step,
+    // so there is no edge to skip.
+    uint32_t enabling_edges;
+
+    // Rising edges while the direction pin changed in the same interrupt
+    uint32_t dir_errors;
+
+    // Direction changes that leave the step pin high
+    uint32_t dir_high_errors;
+
+    // Shortest number of interrupts between rising edges
+    uint32_t min_interval;
+    uint32_t last_rise;
+} channel_record;
+
+static channel_record records[CHANNEL_COUNT];
+static uint32_t interrupts;
+
+// Interrupts where a subset of the channels had a rising step edge
+static uint32_t unmatched_edges;
+
+void __real_TIMER1_COMPA_vect(void);
+
+static pin_state read_pins(uint8_t i)
+{
+    const pins *p = &channel_pins[i];
+    return (pin_state) {
+        .enabled = !(*p->enable.port & p->enable.mask),
+        .step = *p->step.port & p->step.mask,
+        .dir = *p->dir.port & p->dir.mask
+    };
+}
+
+void __wrap_TIMER1_COMPA_vect(void)
+{
+    pin_state before[CHANNEL_COUNT], after[CHANNEL_COUNT];
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        before[i] = read_pins(i);
+
+    __real_TIMER1_COMPA_vect();
+    interrupts++;
+
+    uint8_t rising = 0;
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        after[i] = read_pins(i);
+        channel_record *r = &records[i];
+        if (before[i].dir != after[i].dir && after[i].step)
+            r->dir_high_errors++;
+
+        if (before[i].step || !after[i].step)
+            continue;
+
+        rising++;
+        if (!before[i].enabled && after[i].enabled)
+        {
+            r->enabling_edges++;
+            continue;
+        }
+
+        if (before[i].dir != after[i].dir)
+            r->dir_errors++;
+
+        r->steps += after[i].dir ? 1 : -1;
+        if (r->last_rise && interrupts - r->last_rise < r->min_interval)
+            r->min_interval = interrupts - r->last_rise;
+        r->last_rise = interrupts;
+    }
+
+    if (rising && rising != CHANNEL_COUNT)
+        unmatched_edges++;
+}
+
+static void reset_records(void)
+{
+    memset(records, 0, sizeof(records));
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        records[i].min_interval = UINT32_MAX;
+
+    unmatched_edges = 0;
+}
+
+// Run until every channel has stopped, returning false if that takes more than timeout_ms
+static bool run_until_stopped(uint32_t timeout_ms)
+{
+    for (uint32_t ms = 0; ms < timeout_ms; ms += 10)
+    {
+        sim_firmware_run_ms(10);
+        bool moving = false;
+        for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+            moving |= stepper_moving(i);
+
+        if (!moving)
+            return true;
+    }
+
+    return false;
+}
+
+static int32_t position(uint8_t i)
+{
+    int32_t target, current;
+    stepper_status(i, &target, &current);
+    return current;
+}
+
+// Check a completed move from start_steps (internal units) to target (external units)
+static void check_move(uint8_t i, int32_t start_steps, int32_t target)
+{
+    const channel_record *r = &records[i];
+    CHECK(r->steps == target * STEPS_PER_POSITION - start_steps);
+    CHECK(r->enabling_edges <= 1);
+    CHECK(r->dir_errors == 0);
+    CHECK(r->dir_high_errors == 0);
+    CHECK(r->min_interval >= 2);
+    CHECK(position(i) == target);
+    CHECK(!read_pins(i).enabled);
+    CHECK(!stepper_moving(i));
+}
+
+static void test_move(int32_t distance)
+{
+    reset_records();
+    int32_t start_steps = current_steps[0];
+    int32_t target = position(0) + distance;
+    stepper_set_target(0, target);
+    CHECK(run_until_stopped(10000));
+    check_move(0, start_steps, target);
+}
+
+static void test_reverse(void)
+{
+    // Reversing part way through a move changes the direction without a step
+    // edge in the same interrupt, and finishes at the new target.
+    // The reversals fall on both phases of the step pin.
+    reset_records();
+    int32_t start_steps = current_steps[0];
+    int32_t start = position(0);
+    for (uint8_t j = 0; j < 8; j++)
+    {
+        stepper_set_target(0, start + (j % 2 ? -50 : 100));
+        sim_firmware_run_ms(20 + j);
+        CHECK(stepper_moving(0));
+    }
+
+    CHECK(run_until_stopped(10000));
+    check_move(0, start_steps, start - 50);
+}
+
+static void test_stop(void)
+{
+    // Stopping part way through a move leaves the position at the last step made
+    reset_records();
+    int32_t start_steps = current_steps[0];
+    stepper_set_target(0, position(0) + 1000);
+    sim_firmware_run_ms(200);
+    stepper_stop(0);
+    CHECK(run_until_stopped(1000));
+
+    const channel_record *r = &records[0];
+    CHECK(r->steps > 0 && r->steps < 1000 * STEPS_PER_POSITION);
+    CHECK(current_steps[0] == start_steps + r->steps);
+    CHECK(r->dir_errors == 0);
+    CHECK(!read_pins(0).enabled);
+}
+
+static void test_schedule(void)
+{
+    // A scheduled move doesn't start until the device clock reaches its time
+    reset_records();
+    int32_t start_steps = current_steps[0];
+    int32_t target = position(0) + 30;
+    stepper_schedule_target(0, target, clock_millis() + 500);
+    sim_firmware_run_ms(400);
+    CHECK(!stepper_moving(0));
+    CHECK(records[0].enabling_edges == 0);
+    sim_firmware_run_ms(200);
+    CHECK(stepper_moving(0));
+    CHECK(run_until_stopped(1000));
+    check_move(0, start_steps, target);
+}
+
+#ifdef POWER_SENSE_ADC
+static void test_power_failure(void)
+{
+    // A supply failure stops the motors part way through a move and saves the
+    // positions they reached. The move and a scheduled move on the same channel
+    // continue once the supply returns.
+    reset_records();
+    int32_t start_steps = current_steps[0];
+    int32_t target = position(0) + 1000;
+    stepper_set_target(0, target);
+    stepper_schedule_target(0, target - 20, clock_millis() + 300);
+    sim_firmware_run_ms(200);
+
+    uint64_t start = sim_now_ns();
+    sim_set_supply_failing(true);
+    sim_firmware_run_ms(1);
+    uint64_t failed = sim_now_ns();
+
+    int32_t stopped_steps = current_steps[0];
+    CHECK(records[0].steps == stopped_steps - start_steps);
+    CHECK(stopped_steps > start_steps);
+    CHECK(!read_pins(0).enabled);
+    CHECK(!stepper_moving(0));
+
+    journal_channel channels[CHANNEL_COUNT];
+    CHECK(journal_load(channels) && channels[0].position == stopped_steps);
+
+    // The save runs inside the interrupt, which takes at least one EEPROM write (3.4 ms)
+    CHECK(failed - start > 3400000);
+
+    // Nothing moves while the supply is off, even once the scheduled move is due
+    sim_firmware_run_ms(500);
+    CHECK(current_steps[0] == stopped_steps);
+    CHECK(!read_pins(0).enabled);
+
+    int32_t reported_target, reported_current;
+    stepper_status(0, &reported_target, &reported_current);
+    CHECK(reported_target == target);
+    CHECK(reported_current == stopped_steps / STEPS_PER_POSITION);
+
+    sim_set_supply_failing(false);
+    CHECK(run_until_stopped(10000));
+    check_move(0, start_steps, target - 20);
+}
+#endif
+
+#if CHANNELS == 2
+static void test_simultaneous(void)
+{
+    // Equal moves on both channels step on the same interrupts.
+    // This runs first, so that both step pins start low.
+    reset_records();
+    int32_t start_steps[CHANNEL_COUNT];
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        start_steps[i] = current_steps[i];
+        stepper_set_target(i, position(i) + 200);
+    }
+
+    CHECK(run_until_stopped(10000));
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        check_move(i, start_steps[i], 200);
+    CHECK(unmatched_edges == 0);
+}
+#endif
+
+static uint16_t record_address(uint8_t index)
+{
+    return JOURNAL_EEPROM_ADDRESS + index * sizeof(journal_record);
+}
+
+// Write a record whose positions are derived from its sequence number
+static void write_record(uint8_t index, uint16_t sequence, bool valid)
+{
+    journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.sequence = sequence;
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        record.channels[i].position = sequence * 10 + i;
+
+    const uint8_t *bytes = (const uint8_t *)&record;
+    for (uint8_t i = 0; i < offsetof(journal_record, crc); i++)
+        record.crc = _crc_ibutton_update(record.crc, bytes[i]);
+
+    if (!valid)
+        record.crc ^= 0x01;
+
+    sim_eeprom_write(record_address(index), &record, sizeof(record));
+}
+
+static void erase_journal(void)
+{
+    uint8_t erased[JOURNAL_RECORDS * sizeof(journal_record)];
+    memset(erased, 0xFF, sizeof(erased));
+    sim_eeprom_write(JOURNAL_EEPROM_ADDRESS, erased, sizeof(erased));
+}
+
+// Fill the ring so that the newest record is at index newest with the given sequence
+// number, and the records after it are left from the previous lap
+static void fill_journal(uint8_t newest, uint16_t sequence)
+{
+    for (uint8_t j = 0; j < JOURNAL_RECORDS; j++)
+    {
+        uint16_t offset = j <= newest ? newest - j : newest - j + JOURNAL_RECORDS;
+        write_record(j, sequence - offset, true);
+    }
+}
+
+static bool check_loaded(uint16_t sequence)
+{
+    journal_channel channels[CHANNEL_COUNT];
+    if (!CHECK(journal_load(channels)))
+        return false;
+
+    bool ok = true;
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        ok &= CHECK(channels[i].position == (int32_t)(uint16_t)sequence * 10 + i);
+
+    return ok;
+}
+
+// Save the positions that write_record would give the expected sequence number
+static void save_record(uint16_t sequence)
+{
+    journal_channel channels[CHANNEL_COUNT];
+    memset(channels, 0, sizeof(channels));
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        channels[i].position = sequence * 10 + i;
+
+    journal_save(channels);
+}
+
+static void test_journal_search(void)
+{
+    // The binary search finds the newest record at every index of the ring,
+    // including where the sequence numbers wrap past 65535
+    const uint16_t sequences[] = { 1000, 65535, 2 };
+    for (uint8_t k = 0; k < sizeof(sequences) / sizeof(sequences[0]); k++)
+    {
+        for (uint8_t newest = 0; newest < JOURNAL_RECORDS; newest++)
+        {
+            fill_journal(newest, sequences[k]);
+            if (!check_loaded(sequences[k]))
+                break;
+        }
+    }
+
+    // A partly filled ring on the first lap
+    erase_journal();
+    for (uint8_t j = 0; j < 5; j++)
+        write_record(j, j + 1, true);
+    check_loaded(5);
+
+    // The next save follows the newest record, wrapping to the start of the ring
+    fill_journal(JOURNAL_RECORDS - 1, 65535);
+    check_loaded(65535);
+
+    save_record(0);
+    journal_record record;
+    sim_eeprom_read(record_address(0), &record, sizeof(record));
+    CHECK(record.sequence == 0);
+    check_loaded(0);
+}
+
+static void test_journal_torn(void)
+{
+    // A record that fails its CRC (e.g. because a power loss interrupted the write)
+    // ends the search, leaving the previous record as the newest
+    fill_journal(10, 500);
+    write_record(10, 500, false);
+    check_loaded(499);
+
+    // The first record of a new lap was interrupted
+    fill_journal(JOURNAL_RECORDS - 1, 2000);
+    write_record(0, 2001, false);
+    check_loaded(2000);
+
+    // The interrupted record is overwritten by the next save
+    fill_journal(10, 500);
+    write_record(11, 501, false);
+    check_loaded(500);
+
+    save_record(501);
+    journal_record record;
+    sim_eeprom_read(record_address(11), &record, sizeof(record));
+    CHECK(record.sequence == 501);
+    check_loaded(501);
+}
+
+static void test_journal_legacy(void)
+{
+    // Without a valid journal record the positions are read from the dwords
+    // saved by earlier firmware at the start of the EEPROM
+    erase_journal();
+    journal_channel channels[CHANNEL_COUNT];
+    CHECK(!journal_load(channels));
+
+    write_record(0, 1, false);
+    CHECK(!journal_load(channels));
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        uint32_t legacy = 1234 * STEPS_PER_POSITION + i;
+        sim_eeprom_write(4 * i, &legacy, sizeof(legacy));
+    }
+
+    stepper_initialize();
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        CHECK(current_steps[i] == 1234 * STEPS_PER_POSITION + i);
+        CHECK(position(i) == 1234);
+        CHECK(!stepper_moving(i));
+    }
+}
+
+int main(void)
+{
+    sim_firmware_start();
+
+    // The erased EEPROM doesn't hold a valid position
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        stepper_zero(i);
+
+#if CHANNELS == 2
+    test_simultaneous();
+#endif
+    test_move(100);
+    test_move(-37);
+    test_move(1);
+    test_reverse();
+    test_stop();
+    test_schedule();
+#ifdef POWER_SENSE_ADC
+    test_power_failure();
+#endif
+
+    // These replace the saved positions, so run last
+    test_journal_search();
+    test_journal_torn();
+    test_journal_legacy();
+
+    return test_finish("test_stepper");
+}
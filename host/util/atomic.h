@@ -0,0 +1,27 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc atomic blocks.
+// The block holds off the simulated interrupts, which run when it ends
+// (see sim_atomic_end). As in avr-libc, the interrupt state is also restored
+// if the block is left early with return or break.
+
+#include <stdbool.h>
+
+#ifndef FOCUSER_HOST_UTIL_ATOMIC_H
+#define FOCUSER_HOST_UTIL_ATOMIC_H
+
+bool sim_atomic_begin(void);
+void sim_atomic_end(bool enabled);
+
+static inline void sim_atomic_restore(const bool *enabled)
+{
+    sim_atomic_end(*enabled);
+}
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (bool __enabled __attribute__((cleanup(sim_atomic_restore))) = sim_atomic_begin(), \
+    __done = false; !__done; __done = true)
+
+#endif
@@ -0,0 +1,32 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc CRC helpers
+
+#include <stdint.h>
+
+#ifndef FOCUSER_HOST_UTIL_CRC16_H
+#define FOCUSER_HOST_UTIL_CRC16_H
+
+// Dallas/Maxim 1-wire CRC8 (polynomial x^8 + x^5 + x^4 + 1)
+static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+    crc = crc ^ data;
+    for (uint8_t i = 0; i < 8; i++)
+        crc = crc & 0x01 ? (crc >> 1) ^ 0x8C : crc >> 1;
+
+    return crc;
+}
+
+// CRC-16 (polynomial x^16 + x^15 + x^2 + 1, reflected)
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++)
+        crc = crc & 0x01 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+
+    return crc;
+}
+
+#endif
@@ -0,0 +1,14 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+// Host replacement for the avr-libc busy-wait delays.
+// Delays advance the simulated time instead of waiting.
+
+#ifndef FOCUSER_HOST_UTIL_DELAY_H
+#define FOCUSER_HOST_UTIL_DELAY_H
+
+void _delay_us(double us);
+void _delay_ms(double ms);
+
+#endif
@@ -0,0 +1,108 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "journal.h"
+
+// The stepper positions are saved after every move and compensation correction,
+// which would wear out a fixed EEPROM location within a few years. Instead each
+// save appends a record to a ring that fills the end of the EEPROM, so each cell
+// is only written once per lap. Records are 15 bytes with one channel and 27 bytes
+// with two, so the ring holds 42 or 23 records.
+//
+// Records are written in order with consecutive sequence numbers, so the records
+// from the first onwards match the sequence of the first record plus their index
+// up to the newest record, and don't match after it (they are either erased or
+// left from the previous lap). The newest record can then be found with a binary
+// search. A record that was interrupted by a power loss fails its CRC and ends
+// the search early, leaving the previous record as the newest.
+
+// After the probe slots (up to 16 x 8 bytes from 0x100)
+#define JOURNAL_EEPROM_ADDRESS 0x180
+
+typedef struct
+{
+    uint16_t sequence;
+    journal_channel channels[CHANNEL_COUNT];
+    uint8_t crc;
+} journal_record;
+
+#define JOURNAL_RECORDS ((E2END + 1 - JOURNAL_EEPROM_ADDRESS) / sizeof(journal_record))
+
+// Index and sequence number of the newest record
+static uint8_t newest = JOURNAL_RECORDS - 1;
+static uint16_t sequence;
+
+static uint8_t crc8(const uint8_t *data, uint8_t length)
+{
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < length; i++)
+        crc = _crc_ibutton_update(crc, data[i]);
+
+    return crc;
+}
+
+static void *record_address(uint8_t index)
+{
+    return (void *)(JOURNAL_EEPROM_ADDRESS + index * sizeof(journal_record));
+}
+
+static bool read_record(uint8_t index, journal_record *record)
+{
+    eeprom_read_block(record, record_address(index), sizeof(journal_record));
+    return record->crc == crc8((const uint8_t *)record, offsetof(journal_record, crc));
+}
+
+// Load the channel state from the newest record
+// Returns false if the journal is empty
+bool journal_load(journal_channel channels[CHANNEL_COUNT])
+{
+    journal_record record;
+    if (!read_record(0, &record))
+    {
+        // The journal is empty, unless a power loss interrupted the start of a new lap
+        if (!read_record(JOURNAL_RECORDS - 1, &record))
+            return false;
+
+        newest = JOURNAL_RECORDS - 1;
+    }
+    else
+    {
+        uint16_t first = record.sequence;
+        uint8_t low = 0;
+        uint8_t high = JOURNAL_RECORDS;
+        while (high - low > 1)
+        {
+            uint8_t mid = (low + high) / 2;
+            if (read_record(mid, &record) && record.sequence == (uint16_t)(first + mid))
+                low = mid;
+            else
+                high = mid;
+        }
+
+        newest = low;
+        read_record(newest, &record);
+    }
+
+    sequence = record.sequence;
+    memcpy(channels, record.channels, sizeof(record.channels));
+    return true;
+}
+
+void journal_save(const journal_channel channels[CHANNEL_COUNT])
+{
+    journal_record record;
+    record.sequence = ++sequence;
+    memcpy(record.channels, channels, sizeof(record.channels));
+    record.crc = crc8((const uint8_t *)&record, offsetof(journal_record, crc));
+
+    newest = (newest + 1) % JOURNAL_RECORDS;
+    eeprom_update_block(&record, record_address(newest), sizeof(journal_record));
+}
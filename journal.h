@@ -0,0 +1,32 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "stepper.h"
+
+#ifndef FOCUSER_JOURNAL_H
+#define FOCUSER_JOURNAL_H
+
+// The state of a channel that must be restored consistently after a power cycle.
+// Each record holds every channel, so the position and the temperature
+// compensation it includes are always written together.
+typedef struct
+{
+    // Target position (internal steps)
+    int32_t position;
+
+    // Compensation offset (steps) that is included in the position,
+    // the filtered temperature (1/16 C) it was calculated for, and a CRC of
+    // the settings it was calculated for. Only valid if compensated is set.
+    int32_t offset;
+    int16_t applied;
+    uint8_t settings_crc;
+    bool compensated;
+} journal_channel;
+
+bool journal_load(journal_channel channels[CHANNEL_COUNT]);
+void journal_save(const journal_channel channels[CHANNEL_COUNT]);
+
+#endif
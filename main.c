@@ -7,13 +7,21 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <math.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "clock.h"
+#include "compensation.h"
+#include "config.h"
 #include "ds18b20.h"
 #include "gpio.h"
+#include "history.h"
+#include "power.h"
+#include "stepper.h"
+#include "temperature.h"
 #include "usb.h"
 
 #define F_CPU 16000000UL
@@ -21,314 +29,540 @@
 
 #define length(array) (sizeof(array)/sizeof(*(array)))
 
-typedef struct
+gpin_t usb_conn_led = { &PORTC, &PINC, &DDRC, _BV(PD7) };
+gpin_t usb_rx_led = { &PORTB, &PINB, &DDRB, _BV(PB0) };
+gpin_t usb_tx_led = { &PORTD, &PIND, &DDRD, _BV(PD5) };
+
+gpin_t fans = { &PORTB, &PINB, &DDRB, _BV(PB5) };
+gpin_t onewire_bus = { &PORTF, &PINF, &DDRF, _BV(PF1) };
+
+volatile bool led_active;
+char output[64];
+
+bool fans_enabled = false;
+
+static void print_string(char *message)
+{
+    usb_write_data(message, strlen(message));
+}
+
+static int8_t parse_hex_digit(char c)
 {
-    gpin_t enable;
-    gpin_t step;
-    gpin_t dir;
-} channel;
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
 
-channel channels[] = {
+// Parse a probe reference: either a 1-2 digit probe index or a 16 character hex address
+// Returns false if the reference is malformed, otherwise sets probe to the
+// directory position of the probe or -1 if it is not known
+static bool parse_probe(const char *ref, uint8_t length, int8_t *probe)
+{
+    if (length == 16)
     {
-        .enable = { &PORTD, &PIND, &DDRD, PD1 },
-        .step = { &PORTB, &PINB, &DDRB, PB2 },
-        .dir = { &PORTB, &PINB, &DDRB, PB1 }
-    },
-#if CHANNELS == 2
+        uint8_t address[8];
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            int8_t high = parse_hex_digit(ref[2 * i]);
+            int8_t low = parse_hex_digit(ref[2 * i + 1]);
+            if (high < 0 || low < 0)
+                return false;
+
+            address[i] = (high << 4) | low;
+        }
+
+        *probe = temperature_find_address(address);
+        return true;
+    }
+
+    if (length < 1 || length > 2)
+        return false;
+
+    uint8_t index = 0;
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (ref[i] < '0' || ref[i] > '9')
+            return false;
+        index = 10 * index + ref[i] - '0';
+    }
+
+    *probe = temperature_find_index(index);
+    return true;
+}
+
+// Responses that may be longer than the send buffer are written by a stream
+// function, which is called from the main loop until it returns true. Each call
+// writes the parts that fit and keeps its place in stream_item and stream_part,
+// so a slow host doesn't hold up the stepper, temperature and compensation
+// updates. Further commands wait until the response is complete.
+static bool (*stream)(void);
+static uint32_t stream_item;
+static uint8_t stream_part;
+
+// Sequence number that ends a history download
+static uint32_t stream_end;
+
+// Statistics for each probe index since the last H query, which are then reset
+static bool stream_statistics(void)
+{
+    for (; stream_item <= TEMPERATURE_MAX_PROBES; stream_item++)
     {
-        .enable = { &PORTB, &PINB, &DDRB, PB6 },
-        .step = { &PORTD, &PIND, &DDRD, PD4 },
-        .dir = { &PORTD, &PIND, &DDRD, PD0 }
+        history_statistics stats;
+        if (!history_probe_statistics(stream_item - 1, &stats))
+            continue;
+
+        char min[10], max[10];
+        ds18b20_format(stats.min, min);
+        ds18b20_format(stats.max, max);
+        sprintf(output, "%d,N=%" PRIu32 ",L=%s,H=%s,M=%.4f,R=%+.4f\r\n", (uint8_t)stream_item, stats.count,
+            min, max, stats.mean / 16, stats.rate / 16);
+        if (!usb_stream_write(output, strlen(output)))
+            return false;
+
+        history_reset_statistics(stream_item - 1);
     }
-#elif CHANNELS > 2
-    #error Only 1 or 2 channels are supported
-#endif
-};
 
-#define CHANNEL_COUNT (sizeof(channels)/sizeof(*(channels)))
+    sprintf(output, "S=%" PRIu32 "\r\n", history_next_sequence());
+    return usb_stream_write(output, strlen(output));
+}
 
-gpin_t usb_conn_led = { &PORTC, &PINC, &DDRC, PD7 };
-gpin_t usb_rx_led = { &PORTB, &PINB, &DDRB, PB0 };
-gpin_t usb_tx_led = { &PORTD, &PIND, &DDRD, PD5 };
+// History samples from stream_item to stream_end, one line per sample.
+// stream_part is 0 for the start of the line, then the probe index of each reading,
+// and TEMPERATURE_MAX_PROBES + 1 for the line ending.
+static bool stream_history(void)
+{
+    uint32_t time;
+    const int16_t *readings;
+    for (; stream_item < stream_end && history_sample(stream_item, &time, &readings); stream_item++)
+    {
+        for (; stream_part <= TEMPERATURE_MAX_PROBES + 1; stream_part++)
+        {
+            if (stream_part == 0)
+                sprintf(output, "%" PRIu32 ",T=%" PRIu32, stream_item, time);
+            else if (stream_part <= TEMPERATURE_MAX_PROBES)
+            {
+                int16_t reading = readings[stream_part - 1];
+                if (reading == HISTORY_READING_UNKNOWN)
+                    continue;
 
-gpin_t fans = { &PORTB, &PINB, &DDRB, PB5 };
-gpin_t onewire_bus = { &PORTF, &PINF, &DDRF, PF1 };
+                char temp[10];
+                ds18b20_format(reading, temp);
+                sprintf(output, ",%d=%s", stream_part, temp);
+            }
+            else
+                strcpy(output, "\r\n");
 
-// The raw motor resolution is too fine to be useful
-// Work internally at 64x resolution, which allows 7 digits of external resolution.
+            if (!usb_stream_write(output, strlen(output)))
+                return false;
+        }
 
-#define DOWNSAMPLE_BITS 4
+        stream_part = 0;
+    }
 
-volatile bool led_active;
-char output[256];
+    sprintf(output, "S=%" PRIu32 "\r\n", stream_end);
+    return usb_stream_write(output, strlen(output));
+}
 
-uint8_t command_length = 0;
-char command_buffer[20];
+// Probe list: 1=XXXXXXXXXXXXXXXX,2=...
+// stream_part is set once the first probe has been written
+static bool stream_addresses(void)
+{
+    for (; stream_item <= TEMPERATURE_MAX_PROBES; stream_item++)
+    {
+        int8_t i = temperature_find_index(stream_item);
+        if (i < 0)
+            continue;
 
-int32_t target_steps[CHANNEL_COUNT] = {};
-int32_t current_steps[CHANNEL_COUNT] = {};
-bool enabled[CHANNEL_COUNT] = {};
-bool step_high[CHANNEL_COUNT] = {};
+        const uint8_t *address = temperature_probe_address(i);
+        char *o = output + sprintf(output, "%s%d=", stream_part ? "," : "", (uint8_t)stream_item);
+        for (uint8_t j = 0; j < 8; j++)
+            o += sprintf(o, "%02X", address[j]);
 
-bool fans_enabled = false;
+        if (!usb_stream_write(output, o - output))
+            return false;
 
-static void update_eeprom(uint8_t i, int32_t target)
+        stream_part = 1;
+    }
+
+    return usb_stream_write("\r\n", 2);
+}
+
+// Latest reading of every probe: 1=XX.XXXX,2=FAILED,...,T=1234
+static bool stream_readings(void)
 {
-    // Save the current absolute position so we can recover
-    // the absolute position after a power cycle.
-    // TODO: Implement a wear levelling strategy
-    eeprom_update_dword((uint32_t*)(4 * i), target);
+    for (; stream_item <= TEMPERATURE_MAX_PROBES; stream_item++)
+    {
+        int8_t i = temperature_find_index(stream_item);
+        if (i < 0)
+            continue;
+
+        int16_t reading;
+        if (temperature_probe_reading(i, &reading))
+        {
+            char temp[10];
+            ds18b20_format(reading, temp);
+            sprintf(output, "%d=%s,", (uint8_t)stream_item, temp);
+        }
+        else
+            sprintf(output, "%d=FAILED,", (uint8_t)stream_item);
+
+        if (!usb_stream_write(output, strlen(output)))
+            return false;
+    }
+
+    sprintf(output, "T=%" PRIu32 "\r\n", temperature_sweep_time());
+    return usb_stream_write(output, strlen(output));
 }
 
-static int32_t read_eeprom(uint8_t i)
+static void start_stream(bool (*function)(void), uint32_t item)
 {
-    return eeprom_read_dword((uint32_t*)(4 * i));
+    stream = function;
+    stream_item = item;
+    stream_part = 0;
+    usb_stream_begin();
 }
 
-static void print_string(char *message)
+// Continue the streamed response, if there is one
+static void update_stream(void)
 {
-    usb_write_data(message, strlen(message));
+    if (stream && stream())
+    {
+        stream = NULL;
+        usb_stream_end();
+    }
 }
 
 static void loop(void)
 {
-    while (usb_can_read())
+    char *cb;
+    int16_t command_length;
+    update_stream();
+    while ((command_length = usb_read_line(&cb)) >= 0)
     {
-        int16_t value = usb_read();
-        if (value < 0)
-            break;
+        // Report stepper motor status
+        if (command_length == 1 && cb[0] == '?')
+        {
+            for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+            {
+                int32_t target, current;
+                stepper_status(i, &target, &current);
+                sprintf(output + i * 22, "T%01d=%+07" PRId32 ",C%01d=%+07" PRId32 ",",
+                    i + 1, target, i + 1, current);
+            }
+            
+            sprintf(output + CHANNEL_COUNT * 22 - 1, ",T=%" PRIu32 "\r\n", clock_millis());
+            
+            print_string(output);
+        }
+        else if (command_length == 1 && cb[0] == 'T')
+        {
+            // Report the device clock for host time synchronisation
+            uint32_t ms;
+            uint16_t us;
+            clock_read(&ms, &us);
+            sprintf(output, "T=%" PRIu32 ".%03u,F=%u\r\n", ms, us, usb_frame_number());
+            print_string(output);
+        }
+        // Report temperature statistics for each probe since the last H query, and reset them
+        else if (command_length == 1 && cb[0] == 'H')
+            start_stream(stream_statistics, 1);
+        // Download the history since a sequence number: H1234
+        else if (command_length > 1 && cb[0] == 'H')
+        {
+            char *end;
+            uint32_t sequence = strtoul(cb + 1, &end, 10);
+            if (*end != '\0' || cb[1] < '0' || cb[1] > '9')
+                print_string("?\r\n");
+            else
+            {
+                // Skip samples that have already left the history
+                stream_end = history_next_sequence();
+                if (stream_end - sequence > HISTORY_LENGTH && sequence < stream_end)
+                    sequence = stream_end - HISTORY_LENGTH;
 
-        if (command_length > 0 && (value == '\r' || value == '\n'))
+                start_stream(stream_history, sequence);
+            }
+        }
+        else if (command_length == 1 && cb[0] == '!')
+        {
+            // Report diagnostic counters
+            sprintf(output, "O=%u,C=%u,P=%u,M=%u\r\n", usb_tx_overflows(), ds18b20_crc_failures(),
+                temperature_ignored_count(), stepper_max_latency());
+            print_string(output);
+        }
+        else if (command_length == 1 && cb[0] == 'W')
+        {
+            // Save the configuration to EEPROM
+            config_save();
+            print_string("$\r\n");
+        }
+        else if (command_length == 1 && cb[0] == '#')
+        {
+            // Report fan status
+            sprintf(output, "%d\r\n", fans_enabled);
+            print_string(output);
+        }
+        else if (command_length == 2 && cb[0] == '#' && (cb[1] == '0' || cb[1] == '1'))
         {
-            // Report stepper motor status
-            char *cb = command_buffer;
-            if (command_length == 1 && cb[0] == '?')
+            // Switch fans on or off
+            fans_enabled = cb[1] == '1';
+
+            if (fans_enabled)
+                gpio_output_set_high(&fans);
+            else
+                gpio_output_set_low(&fans);
+
+            usb_status_set_fans(fans_enabled);
+
+            print_string("$\r\n");
+        }
+        // List probes: 1=XXXXXXXXXXXXXXXX,2=...
+        else if (command_length == 1 && cb[0] == '@')
+            start_stream(stream_addresses, 1);
+        // Report every probe from the most recent conversion
+        else if (command_length == 2 && cb[0] == '@' && cb[1] == '*')
+            start_stream(stream_readings, 1);
+        // Query alarm mode: @A
+        else if (command_length == 2 && cb[0] == '@' && cb[1] == 'A')
+        {
+            sprintf(output, "%d\r\n", temperature_alarm_mode());
+            print_string(output);
+        }
+        // Only read probes outside their alarm band: @A[01]
+        else if (command_length == 3 && cb[0] == '@' && cb[1] == 'A' && (cb[2] == '0' || cb[2] == '1'))
+        {
+            temperature_set_alarm_mode(cb[2] == '1');
+            print_string("$\r\n");
+        }
+        else if (command_length > 1 && cb[0] == '@')
+        {
+            char *equals = strchr(cb, '=');
+            char *colon = strchr(cb, ':');
+            char *separator = equals ? equals : colon;
+            uint8_t ref_length = (separator ? separator - cb : command_length) - 1;
+            int8_t probe;
+            if (!parse_probe(cb + 1, ref_length, &probe))
+                print_string("?\r\n");
+
+            // Query probe alarm band: @[probe]:
+            else if (colon && colon[1] == '\0')
             {
-                for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+                int8_t low, high;
+                if (temperature_alarm(probe, &low, &high))
                 {
-                    sprintf(output + i * 22, "T%01d=%+07ld,C%01d=%+07ld,",
-                        i + 1,
-                        target_steps[i] >> DOWNSAMPLE_BITS,
-                        i + 1,
-                        current_steps[i] >> DOWNSAMPLE_BITS);
+                    sprintf(output, "L=%+d,H=%+d\r\n", low, high);
+                    print_string(output);
                 }
-                
-                sprintf(output + CHANNEL_COUNT * 22 - 1, "\r\n");
-                
-                print_string(output);
+                else
+                    print_string("FAILED\r\n");
             }
-            else if (command_length == 1 && cb[0] == '#')
+
+            // Set probe alarm band: @[probe]:[low],[high]
+            else if (colon)
             {
-                // Report fan status
-                sprintf(output, "%d\r\n", fans_enabled);
-                print_string(output);
+                char *end;
+                long low = strtol(colon + 1, &end, 10);
+                bool valid = end != colon + 1 && *end == ',';
+
+                char *start = end + 1;
+                long high = valid ? strtol(start, &end, 10) : 0;
+                valid &= end != start && *end == '\0' && low >= INT8_MIN && high <= INT8_MAX && low <= high;
+
+                if (!valid)
+                    print_string("?\r\n");
+                else
+                    print_string(temperature_set_alarm(probe, low, high) ? "$\r\n" : "FAILED\r\n");
             }
-            else if (command_length == 2 && cb[0] == '#' && (cb[1] == '0' || cb[1] == '1'))
+
+            // Set probe resolution: @[probe]=[9-12]
+            else if (equals)
             {
-                // Switch fans on or off
-                fans_enabled = cb[1] == '1';
+                char *end;
+                long bits = strtol(equals + 1, &end, 10);
+                if (end == equals + 1 || *end != '\0' || bits < 0 || bits > 255)
+                    print_string("?\r\n");
+                else
+                    print_string(temperature_set_resolution(probe, bits) ? "$\r\n" : "FAILED\r\n");
+            }
 
-                if (fans_enabled)
-                    gpio_output_set_high(&fans);
+            // Query probe temperature: @[probe]
+            else
+            {
+                int16_t reading;
+                uint32_t time;
+                if (temperature_reading(probe, &reading, &time))
+                {
+                    char temp[10];
+                    ds18b20_format(reading, temp);
+                    sprintf(output, "%s,T=%" PRIu32 "\r\n", temp, time);
+                    print_string(output);
+                }
                 else
-                    gpio_output_set_low(&fans);
+                    print_string("FAILED\r\n");
+            }
+        }
+        else if (cb[0] > '0' && cb[0] <= '0' + CHANNEL_COUNT)
+        {
+            // 0-indexed channel number
+            uint8_t i = cb[0] - '1';
 
+            // Stop at current position: [1..9]S\r\n
+            if (command_length == 2 && cb[1] == 'S')
+            {
+                stepper_stop(i);
                 print_string("$\r\n");
             }
-            else if (command_length == 1 && cb[0] == '@')
+            // Zero at current position: [1..9]Z\r\n
+            else if (command_length == 2 && cb[1] == 'Z')
             {
-                // Allocate space to find up to 4 sensors
-                uint8_t addresses[4*8];
-                uint8_t found;
-                ds18b20_search(&onewire_bus, &found, addresses, sizeof(addresses));
-
-                for (uint8_t i = 0; i < found; i++)
+                stepper_zero(i);
+                print_string("$\r\n");
+            }
+            // Query temperature compensation: [1..9]K\r\n
+            else if (command_length == 2 && cb[1] == 'K')
+            {
+                compensation_settings settings;
+                int32_t offset;
+                int16_t temperature;
+                bool temperature_valid;
+                compensation_get(i, &settings, &offset, &temperature, &temperature_valid);
+
+                // Longer than the output buffer, but sent as a single message
+                char line[96];
+                char *o = line + sprintf(line, "P=%d,R=%+.4f,C=%+.4f,D=%.4f,O=%+" PRId32 ",F=", settings.probe,
+                    settings.reference / 16.0, settings.coefficient, settings.deadband / 16.0, offset);
+                if (temperature_valid)
                 {
-                    for (uint8_t j = 0; j < 8; j++)
-                        sprintf(output + i * 17 + 2 * j, "%02X", addresses[i * 8 + j]);
-                    output[i * 17 + 16] = ',';
+                    char temp[10];
+                    ds18b20_format(temperature, temp);
+                    sprintf(o, "%s\r\n", temp);
                 }
+                else
+                    sprintf(o, "FAILED\r\n");
 
-                sprintf(output + found * 17 - 1, "\r\n");
-                print_string(output);
+                print_string(line);
             }
-            else if (command_length == 17 && cb[0] == '@')
+            // Set temperature compensation: [1..9]K[probe],[reference C],[steps per C],[deadband C]\r\n
+            // Disable temperature compensation: [1..9]K0\r\n
+            else if (command_length > 2 && cb[1] == 'K')
             {
-                uint8_t address[8];
-                bool failed = false;
-                for (uint8_t i = 0; i < 8; i++)
+                compensation_settings settings = {};
+                char *end;
+                uint32_t probe = strtoul(cb + 2, &end, 10);
+
+                // Check the range before narrowing, so that e.g. 256 isn't read as 0 (disabled)
+                bool valid = end != cb + 2 && probe <= TEMPERATURE_MAX_PROBES;
+                settings.probe = probe;
+                if (valid && settings.probe != 0)
                 {
-                    int temp;
-                    if (!sscanf(command_buffer + 2 * i + 1, "%02X", &temp))
+                    double values[3] = {};
+                    for (uint8_t j = 0; j < 3 && valid; j++)
                     {
-                        failed = true;
-                        break;
+                        char *start = end + 1;
+                        valid = *end == ',';
+                        values[j] = strtod(start, &end);
+                        valid &= end != start;
                     }
 
-                    address[i] = (uint8_t)temp;
-                }
+                    // Limit to the probe range and values that can be reported
+                    valid &= fabs(values[0]) <= 200 && fabs(values[1]) <= 100000 && fabs(values[2]) <= 200;
 
-                if (!failed)
-                {
-                    char temp[10];
-                    if (ds18b20_measure(&onewire_bus, address, temp))
-                    {
-                        sprintf(output, "%s\r\n", temp);
-                        print_string(output);
-                    }
-                    else
-                        print_string("FAILED\r\n");
+                    settings.reference = lround(values[0] * 16);
+                    settings.coefficient = values[1];
+                    settings.deadband = lround(fabs(values[2]) * 16);
                 }
+
+                if (valid && *end == '\0' && compensation_set(i, &settings))
+                    print_string("$\r\n");
                 else
                     print_string("?\r\n");
             }
-            else if (cb[0] > '0' && cb[0] <= '0' + CHANNEL_COUNT)
+            // Move to position: [1..9][+-]1234567\r\n
+            // Move to position at a device clock time: [1..9][+-]1234567@1234567890\r\n
+            else if (command_length > 2 && (cb[1] == '+' || cb[1] == '-'))
             {
-                // 0-indexed channel number
-                uint8_t i = cb[0] - '1';
-
-                // Stop at current position: [1..9]S\r\n
-                if (command_length == 2 && cb[1] == 'S')
+                char *at = strchr(cb, '@');
+                uint8_t position_length = at ? at - cb : command_length;
+                bool is_number = position_length > 2 && position_length <= 9;
+                for (uint8_t i = 2; i < position_length; i++)
                 {
-                    cli();
-
-                    target_steps[i] = current_steps[i];
-                    update_eeprom(i, target_steps[i]);
-
-                    sei();
-                    print_string("$\r\n");
+                    if (cb[i] < '0' || cb[i] > '9')
+                    {
+                        is_number = false;
+                        break;
+                    }
                 }
-                // Zero at current position: [1..9]Z\r\n
-                else if (command_length == 2 && cb[1] == 'Z')
-                {
-                    cli();
-
-                    target_steps[i] = current_steps[i] = 0;
-                    update_eeprom(i, 0);
 
-                    sei();
-                    print_string("$\r\n");
-                }
-                // Move to position: [1..9][+-]1234567\r\n
-                else if (command_length > 2 && (cb[1] == '+' || cb[1] == '-'))
+                if (at)
                 {
-                    bool is_number = command_length <= 9;
-                    for (uint8_t i = 2; i < command_length; i++)
+                    uint8_t time_length = command_length - position_length - 1;
+                    if (time_length == 0 || time_length > 10)
+                        is_number = false;
+
+                    for (uint8_t i = 1; i <= time_length; i++)
                     {
-                        if (cb[i] < '0' || cb[i] > '9')
+                        if (at[i] < '0' || at[i] > '9')
                         {
                             is_number = false;
                             break;
                         }
                     }
-                    
-                    if (is_number)
+                }
+
+                if (is_number)
+                {
+                    // Moves that were followed by a stop command or request are
+                    // acknowledged but discarded, as the stop has already been applied
+                    if (!usb_line_stopped(i))
                     {
-                        // atoi expects a null terminated string
-                        command_buffer[command_length++] = '\0';
+                        // atol stops at the @ separator
                         int32_t target = atol(&cb[1]);
-                        cli();
-
-                        target_steps[i] = target << DOWNSAMPLE_BITS;
-                        update_eeprom(i, target_steps[i]);
-
-                        sei();
-                        print_string("$\r\n");
+                        if (at)
+                            stepper_schedule_target(i, target, strtoul(at + 1, NULL, 10));
+                        else
+                            stepper_set_target(i, target);
                     }
-                    else
-                        print_string("?\r\n");
+
+                    print_string("$\r\n");
                 }
+                else
+                    print_string("?\r\n");
             }
-            else
-                print_string("?\r\n");
-
-            command_length = 0;
         }
         else
-        {
-            command_buffer[command_length] = (uint8_t)value;
-            if (command_length < sizeof(command_buffer))
-                command_length++;
-        }
+            print_string("?\r\n");
+
+        usb_release_line();
+
+        // Start writing a streamed response, which holds off the following commands until it is complete
+        update_stream();
     }
 }
 
 int main(void)
 {
-    OCR1A = 4;
-    TCCR1B = _BV(CS12) | _BV(CS10) | _BV(WGM12);
-    TIMSK1 |= _BV(OCIE1A);
-
-    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
-    {
-        channel *c = &channels[i];
-        gpio_output_set_high(&c->enable);
-        gpio_configure_output(&c->enable);
-
-        gpio_output_set_low(&c->step);
-        gpio_configure_output(&c->step);
-
-        gpio_output_set_low(&c->dir);
-        gpio_configure_output(&c->dir);
-
-        target_steps[i] = current_steps[i] = read_eeprom(i);
-    }
+    clock_initialize();
+    config_initialize();
+    stepper_initialize();
+    power_initialize();
 
     gpio_output_set_low(&fans);
     gpio_configure_output(&fans);
 
     usb_initialize(&usb_conn_led, &usb_rx_led, &usb_tx_led);
+    temperature_initialize(&onewire_bus);
+    compensation_initialize();
 
     sei();
     for (;;)
-        loop();
-}
-
-ISR(TIMER1_COMPA_vect)
-{
-    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
     {
-        channel *c = &channels[i];
-        if (!enabled[i] && current_steps[i] != target_steps[i])
-        {
-            enabled[i] = true;
-            step_high[i] = true;
-            gpio_output_set_high(&c->step);
-            gpio_output_set_low(&c->enable);
-
-            // Skip a step when enabling a motor to avoid losing a count while it powers up
-            continue;
-        }
-        else if (current_steps[i] < target_steps[i])
-        {
-            gpio_output_set_high(&c->dir);
-            if (!step_high[i])
-            {
-                gpio_output_set_high(&c->step);
-                current_steps[i]++;
-            }
-            else
-                gpio_output_set_low(&c->step);
-
-            step_high[i] ^= true;
-        }
-        else if (current_steps[i] > target_steps[i])
-        {
-            gpio_output_set_low(&c->dir);
-            if (!step_high[i])
-            {
-                gpio_output_set_high(&c->step);
-                current_steps[i]--;
-            }
-            else
-                gpio_output_set_low(&c->step);
-
-            step_high[i] ^= true;
-        }
-        else if (enabled[i])
-        {
-            enabled[i] = false;
-            gpio_output_set_high(&c->enable);
-        }
+        loop();
+        stepper_update();
+        temperature_update();
+        compensation_update();
     }
 }
@@ -0,0 +1,433 @@
+//**********************************************************************************
+//  Adapted from https://gist.github.com/stecman/9ec74de5e8a5c3c6341c791d9c233adc
+//  which was released under the Creative Commons Zero licence.
+//  Modifications copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "onewire.h"
+
+// 1-wire transactions are run asynchronously from the Timer3 compare interrupt,
+// one bus event per interrupt. The main loop starts a transaction and then polls
+// onewire_status without ever waiting on the bus.
+//
+// The timing critical parts of each slot (the low pulse of a write-1, the low
+// pulse and sample of a read slot, and the presence sample after a reset) run
+// inside a single interrupt with other interrupts masked, so they can't be
+// stretched by the stepping or USB interrupts. The long waits (reset pulse,
+// write-0 pulse and the slot recovery) are scheduled on the timer, and only
+// become longer if another interrupt delays this one.
+//
+// One Wire timing is based on this Maxim application note
+// https://www.maximintegrated.com/en/app-notes/index.mvp/id/126
+
+// Timer3 runs at F_CPU / 8, giving 2 ticks per microsecond
+#define TICKS_PER_US 2
+
+#define RESET_LOW_US 480
+#define RESET_SAMPLE_US 70
+#define RESET_RECOVERY_US 410
+#define WRITE_ONE_LOW_US 5
+#define WRITE_ZERO_LOW_US 55
+#define READ_LOW_US 1
+#define READ_SAMPLE_US 10
+#define SLOT_US 65
+
+enum phase
+{
+    PHASE_RESET_RELEASE,
+    PHASE_WRITE_ZERO_RELEASE,
+    PHASE_NEXT_SLOT
+};
+
+static const gpin_t *bus;
+static volatile uint8_t status = ONEWIRE_IDLE;
+static uint8_t phase;
+
+// Bytes to write followed by space for the bytes to read
+static uint8_t buffer[ONEWIRE_BUFFER_SIZE];
+static uint8_t tx_length;
+static uint8_t tx_bits;
+static uint8_t total_bits;
+static uint8_t bit_index;
+
+// Search transactions write a command byte and then run
+// a read-bit, read-complement, write-bit triplet for each address bit
+static onewire_search_state *search;
+static uint8_t search_bit;
+static uint8_t triplet_step;
+static uint8_t triplet_reading;
+static int8_t search_last_zero_branch;
+
+void onewire_initialize(const gpin_t *io)
+{
+    bus = io;
+    gpio_configure_input_hiz(bus);
+
+    // Normal mode, F_CPU / 8
+    TCCR3A = 0;
+    TCCR3B = _BV(CS31);
+}
+
+uint8_t onewire_status(void)
+{
+    return status;
+}
+
+static void schedule(uint16_t us)
+{
+    // The counter may be about to tick, so add one tick to guarantee at least the
+    // requested delay (otherwise the reset pulse can fall just short of 480uS)
+    OCR3A = TCNT3 + us * TICKS_PER_US + 1;
+}
+
+static void finish(uint8_t result)
+{
+    TIMSK3 &= ~_BV(OCIE3A);
+    status = result;
+}
+
+static void drive_low(void)
+{
+    gpio_output_set_low_isr(bus);
+    gpio_configure_output_isr(bus);
+}
+
+static void begin(bool reset)
+{
+    status = ONEWIRE_BUSY;
+    bit_index = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        TIFR3 = _BV(OCF3A);
+        if (reset)
+        {
+            // Pull low for >480uS (master reset pulse)
+            drive_low();
+            schedule(RESET_LOW_US);
+            phase = PHASE_RESET_RELEASE;
+        }
+        else
+        {
+            // Start the first slot straight away
+            schedule(1);
+            phase = PHASE_NEXT_SLOT;
+        }
+
+        TIMSK3 |= _BV(OCIE3A);
+    }
+}
+
+/**
+ * Start a transaction that resets the bus, writes tx_length bytes from tx
+ * and then reads rx_length bytes, which are available from onewire_received
+ * once the status is ONEWIRE_DONE.
+ * Returns false if a transaction is already in progress or the buffer is too small.
+ */
+bool onewire_start(const uint8_t *tx, uint8_t tx_length_, uint8_t rx_length)
+{
+    if (status == ONEWIRE_BUSY || tx_length_ + rx_length > ONEWIRE_BUFFER_SIZE)
+        return false;
+
+    memcpy(buffer, tx, tx_length_);
+    tx_length = tx_length_;
+    tx_bits = 8 * tx_length_;
+    total_bits = 8 * (tx_length_ + rx_length);
+    search = NULL;
+
+    begin(true);
+    return true;
+}
+
+/**
+ * Start a transaction that generates a single read slot without resetting the bus.
+ * This is used to poll for the completion of a device operation, which holds
+ * the bus low while it is busy.
+ * The bit is available in the LSB of onewire_received()[0] once the status is ONEWIRE_DONE.
+ */
+bool onewire_start_read_slot(void)
+{
+    if (status == ONEWIRE_BUSY)
+        return false;
+
+    tx_length = tx_bits = 0;
+    total_bits = 1;
+    search = NULL;
+
+    begin(false);
+    return true;
+}
+
+const uint8_t *onewire_received(void)
+{
+    return &buffer[tx_length];
+}
+
+void onewire_search_init(onewire_search_state *state)
+{
+    state->lastZeroBranch = -1;
+    state->done = false;
+    memset(state->address, 0, sizeof(state->address));
+}
+
+/**
+ * Start a search for the next ROM address using the given command
+ * (0xF0 for Search ROM, 0xEC for Alarm Search).
+ *
+ * This algorithm is bit difficult to understand from the diagrams in Maxim's
+ * datasheets and app notes, though its reasonably straight forward once
+ * understood.  I've used the name "last zero branch" instead of Maxim's name
+ * "last discrepancy", since it describes how this variable is used.
+ *
+ * A device address has 64 bits. With multiple devices on the bus, some bits
+ * are ambiguous.  Each time an ambiguous bit is encountered, a zero is written
+ * and the position is marked.  In subsequent searches at ambiguous bits, a one
+ * is written at this mark, zeros are written after the mark, and the bit in
+ * the previous address is copied before the mark. This effectively steps
+ * through all addresses present on the bus.
+ *
+ * For reference, see either of these documents:
+ *
+ *  - Maxim application note 187: 1-Wire Search Algorithm
+ *    https://www.maximintegrated.com/en/app-notes/index.mvp/id/187
+ *
+ *  - Maxim application note 937: Book of iButton® Standards (pages 51-54)
+ *    https://www.maximintegrated.com/en/app-notes/index.mvp/id/937
+ *
+ * The state must remain valid until the transaction completes. A status of
+ * ONEWIRE_DONE means that state->address contains a new address; the search
+ * has finished once state->done is set.
+ * Returns false if a transaction is in progress or the previous search was the end.
+ */
+bool onewire_start_search(uint8_t command, onewire_search_state *state)
+{
+    // Bail out if the previous search was the end
+    if (status == ONEWIRE_BUSY || state->done)
+        return false;
+
+    buffer[0] = command;
+    tx_length = 1;
+    tx_bits = total_bits = 8;
+    search = state;
+    search_bit = 0;
+    triplet_step = 0;
+    search_last_zero_branch = -1;
+
+    begin(true);
+    return true;
+}
+
+/**
+ * Output a Write-0 or Write-1 slot on the One Wire bus
+ * A Write-1 slot is generated unless the passed value is zero
+ */
+static void start_write_slot(uint8_t bit)
+{
+    drive_low();
+    if (bit != 0)
+    {
+        // Pull low for less than 15uS to write a high
+        _delay_us(WRITE_ONE_LOW_US);
+        gpio_output_set_high_isr(bus);
+
+        // Wait for the rest of the minimum slot time
+        schedule(SLOT_US - WRITE_ONE_LOW_US);
+        phase = PHASE_NEXT_SLOT;
+    }
+    else
+    {
+        // Pull low for 60 - 120uS to write a low
+        schedule(WRITE_ZERO_LOW_US);
+        phase = PHASE_WRITE_ZERO_RELEASE;
+    }
+}
+
+/**
+ * Generate a read slot on the One Wire bus and return the bit value
+ * Return 0x0 or 0x1
+ */
+static uint8_t read_slot(void)
+{
+    // Pull the 1-wire bus low for >1uS to generate a read slot
+    drive_low();
+    _delay_us(READ_LOW_US);
+
+    // Configure for reading (releases the line)
+    gpio_configure_input_hiz_isr(bus);
+
+    // Wait for value to stabilise (bit must be read within 15uS of read slot)
+    _delay_us(READ_SAMPLE_US);
+    uint8_t result = gpio_input_read(bus) != 0;
+
+    // Wait for the end of the read slot
+    schedule(SLOT_US - READ_LOW_US - READ_SAMPLE_US);
+    phase = PHASE_NEXT_SLOT;
+    return result;
+}
+
+static void search_slot(void)
+{
+    // States of ROM search reads
+    enum {
+        kConflict = 0b00,
+        kZero = 0b10,
+        kOne = 0b01,
+    };
+
+    if (search_bit == 64)
+    {
+        // If the no branch points were found, mark the search as done.
+        // Otherwise, mark the last zero branch we found for the next search
+        if (search_last_zero_branch == -1)
+            search->done = true;
+        else
+            search->lastZeroBranch = search_last_zero_branch;
+
+        finish(ONEWIRE_DONE);
+        return;
+    }
+
+    // Read the current bit and its complement from the bus
+    if (triplet_step == 0)
+    {
+        triplet_reading = read_slot();
+        triplet_step = 1;
+        return;
+    }
+
+    if (triplet_step == 1)
+    {
+        triplet_reading |= read_slot() << 1;
+        triplet_step = 2;
+        return;
+    }
+
+    uint8_t byteIndex = search_bit / 8;
+    uint8_t bitMask = 1 << (search_bit % 8);
+    uint8_t bitValue;
+
+    switch (triplet_reading)
+    {
+        case kZero:
+        case kOne:
+            // Bit was the same on all responding devices: it is a known value
+            // The first bit is the value we want to write (rather than its complement)
+            bitValue = triplet_reading & 0x1;
+            break;
+
+        case kConflict:
+            // Both 0 and 1 were written to the bus
+            // Use the search state to continue walking through devices
+            if ((int8_t)search_bit == search->lastZeroBranch)
+            {
+                // Current bit is the last position the previous search chose a zero: send one
+                bitValue = 1;
+            }
+            else if ((int8_t)search_bit < search->lastZeroBranch)
+            {
+                // Before the lastZeroBranch position, repeat the same choices as the previous search
+                bitValue = (search->address[byteIndex] & bitMask) != 0;
+            }
+            else
+            {
+                // Current bit is past the lastZeroBranch in the previous search: send zero
+                bitValue = 0;
+            }
+
+            // Remember the last branch where a zero was written for the next search
+            if (bitValue == 0)
+                search_last_zero_branch = search_bit;
+
+            break;
+
+        default:
+            // If we see "11" there was a problem on the bus (no devices pulled it low)
+            search->done = true;
+            finish(ONEWIRE_SEARCH_FAILED);
+            return;
+    }
+
+    // Write bit into address
+    if (bitValue == 0)
+        search->address[byteIndex] &= ~bitMask;
+    else
+        search->address[byteIndex] |= bitMask;
+
+    // Write bit to the bus to continue the search
+    start_write_slot(bitValue);
+    triplet_step = 0;
+    search_bit++;
+}
+
+static void next_slot(void)
+{
+    if (bit_index < tx_bits)
+    {
+        // Write bytes LSB first
+        start_write_slot(buffer[bit_index / 8] & (1 << (bit_index % 8)));
+        bit_index++;
+    }
+    else if (search)
+        search_slot();
+    else if (bit_index < total_bits)
+    {
+        // Read bytes LSB first
+        uint8_t *byte = &buffer[bit_index / 8];
+        uint8_t bitMask = 1 << (bit_index % 8);
+        if (read_slot())
+            *byte |= bitMask;
+        else
+            *byte &= ~bitMask;
+
+        bit_index++;
+    }
+    else
+        finish(ONEWIRE_DONE);
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+    switch (phase)
+    {
+        case PHASE_RESET_RELEASE:
+        {
+            // Release the bus and look for the line pulled low by a slave
+            gpio_configure_input_hiz_isr(bus);
+            _delay_us(RESET_SAMPLE_US);
+            uint8_t result = gpio_input_read(bus);
+
+            if (result != 0)
+            {
+                // No devices present on the bus, so there is nothing left to search
+                if (search)
+                    search->done = true;
+
+                finish(ONEWIRE_NO_PRESENCE);
+                break;
+            }
+
+            // Wait for the presence pulse to finish
+            // This should be less than 240uS, but the master is expected to stay
+            // in Rx mode for a minimum of 480uS in total
+            schedule(RESET_RECOVERY_US);
+            phase = PHASE_NEXT_SLOT;
+            break;
+        }
+        case PHASE_WRITE_ZERO_RELEASE:
+            // Stop pulling down line and wait for the recovery time between slots
+            gpio_output_set_high_isr(bus);
+            schedule(SLOT_US - WRITE_ZERO_LOW_US);
+            phase = PHASE_NEXT_SLOT;
+            break;
+        case PHASE_NEXT_SLOT:
+            next_slot();
+            break;
+    }
+}
@@ -0,0 +1,55 @@
+//**********************************************************************************
+//  Adapted from https://gist.github.com/stecman/9ec74de5e8a5c3c6341c791d9c233adc
+//  which was released under the Creative Commons Zero licence.
+//  Modifications copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "gpio.h"
+
+#ifndef FOCUSER_ONEWIRE_H
+#define FOCUSER_ONEWIRE_H
+
+// Maximum number of bytes written and read in a single transaction
+#define ONEWIRE_BUFFER_SIZE 24
+
+// Transaction status
+enum onewire_status
+{
+    ONEWIRE_IDLE,
+    ONEWIRE_BUSY,
+    ONEWIRE_DONE,
+    ONEWIRE_NO_PRESENCE,
+    ONEWIRE_SEARCH_FAILED
+};
+
+/**
+ * State for the onewire_start_search function
+ * This must be initialised with onewire_search_init() before use.
+ */
+typedef struct onewire_search_state {
+
+    // The highest bit position where a bit was ambiguous and a zero was written
+    int8_t lastZeroBranch;
+
+    // Internal flag to indicate if the search is complete
+    // This flag is set once there are no more branches to search
+    bool done;
+
+    // Discovered 64-bit device address (LSB first)
+    // After a successful search, this contains the found device address.
+    // During a search this is overwritten LSB-first with a new address.
+    uint8_t address[8];
+
+} onewire_search_state;
+
+void onewire_initialize(const gpin_t *io);
+uint8_t onewire_status(void);
+bool onewire_start(const uint8_t *tx, uint8_t tx_length, uint8_t rx_length);
+bool onewire_start_read_slot(void);
+const uint8_t *onewire_received(void);
+void onewire_search_init(onewire_search_state *state);
+bool onewire_start_search(uint8_t command, onewire_search_state *state);
+
+#endif
@@ -0,0 +1,88 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+#include <util/delay.h>
+#include "power.h"
+#include "stepper.h"
+
+// The motor supply is monitored through a resistor divider on the POWER_SENSE_ADC
+// pin, which must read below the 1.1V bandgap reference when the supply is failing.
+// The analog comparator interrupts as soon as the divided voltage crosses the
+// reference, so the stepper positions can be saved while the hold-up capacitance
+// keeps the controller running. The targets are kept while the supply is off, so
+// the moves continue if it returns before the controller loses power.
+
+#ifdef POWER_SENSE_ADC
+
+static bool supply_ok = true;
+
+// Interrupt when the comparator output rises (supply failing) or falls (supply returned)
+static void set_edge(bool rising)
+{
+    // The interrupt must be disabled while the edge is changed
+    ACSR &= ~_BV(ACIE);
+    if (rising)
+        ACSR |= _BV(ACIS1) | _BV(ACIS0);
+    else
+        ACSR = (ACSR & ~_BV(ACIS0)) | _BV(ACIS1);
+
+    ACSR |= _BV(ACI);
+    ACSR |= _BV(ACIE);
+}
+
+static void update(void)
+{
+    for (;;)
+    {
+        // The output is high when the bandgap reference is above the divided supply
+        bool ok = !(ACSR & _BV(ACO));
+        if (ok != supply_ok)
+        {
+            supply_ok = ok;
+            if (ok)
+                stepper_power_restored();
+            else
+                stepper_power_failed();
+        }
+
+        // Wait for the opposite transition, unless it happened while the edge was changed
+        set_edge(ok);
+        if (ok == !(ACSR & _BV(ACO)))
+            break;
+    }
+}
+
+void power_initialize(void)
+{
+    // Compare the bandgap reference against the sense pin through the ADC multiplexer
+    ADCSRA &= ~_BV(ADEN);
+    ADMUX = (ADMUX & ~0x07) | (POWER_SENSE_ADC & 0x07);
+#if POWER_SENSE_ADC >= 8
+    ADCSRB |= _BV(ACME) | _BV(MUX5);
+    DIDR2 |= _BV(POWER_SENSE_ADC - 8);
+#else
+    ADCSRB = (ADCSRB & ~_BV(MUX5)) | _BV(ACME);
+    DIDR0 |= _BV(POWER_SENSE_ADC);
+#endif
+
+    ACSR = _BV(ACBG);
+
+    // Wait for the bandgap reference to settle
+    _delay_us(100);
+    update();
+}
+
+ISR(ANALOG_COMP_vect)
+{
+    update();
+}
+
+#else
+
+void power_initialize(void) {}
+
+#endif
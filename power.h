@@ -0,0 +1,14 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#ifndef FOCUSER_POWER_H
+#define FOCUSER_POWER_H
+
+#if defined(POWER_SENSE_ADC) && (POWER_SENSE_ADC < 0 || POWER_SENSE_ADC > 13 || POWER_SENSE_ADC == 2 || POWER_SENSE_ADC == 3)
+    #error POWER_SENSE must be an ADC channel between 0 and 13 (except 2 and 3)
+#endif
+
+void power_initialize(void);
+
+#endif
@@ -0,0 +1,403 @@
+//**********************************************************************************
+//  Copyright 2016, 2017, 2022, 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "clock.h"
+#include "compensation.h"
+#include "gpio.h"
+#include "journal.h"
+#include "stepper.h"
+
+typedef struct
+{
+    gpin_t enable;
+    gpin_t step;
+    gpin_t dir;
+
+    // Index of each pin's port in ports, set by stepper_initialize
+    uint8_t enable_port;
+    uint8_t step_port;
+    uint8_t dir_port;
+} channel;
+
+channel channels[CHANNEL_COUNT] = {
+    {
+        .enable = { &PORTD, &PIND, &DDRD, _BV(PD1) },
+        .step = { &PORTB, &PINB, &DDRB, _BV(PB2) },
+        .dir = { &PORTB, &PINB, &DDRB, _BV(PB1) }
+    },
+#if CHANNELS == 2
+    {
+        .enable = { &PORTB, &PINB, &DDRB, _BV(PB6) },
+        .step = { &PORTD, &PIND, &DDRD, _BV(PD4) },
+        .dir = { &PORTD, &PIND, &DDRD, _BV(PD0) }
+    }
+#endif
+};
+
+// The raw motor resolution is too fine to be useful
+// Work internally at 64x resolution, which allows 7 digits of external resolution.
+
+#define DOWNSAMPLE_BITS 4
+
+// Nominal time between stepping interrupts (F_CPU / 1024 / 5)
+#define STEP_INTERVAL_US 320
+
+// Positions are saved once the motors stop, or after this long if they are still moving
+#define SAVE_DELAY_MS 1000
+
+// The stepping ISR collects the pin changes for every channel and then writes
+// each port once, so that the step edges of the channels are simultaneous.
+#define MAX_PORTS (3 * CHANNEL_COUNT)
+static volatile uint8_t *ports[MAX_PORTS];
+static uint8_t port_count;
+
+int32_t target_steps[CHANNEL_COUNT] = {};
+int32_t current_steps[CHANNEL_COUNT] = {};
+bool enabled[CHANNEL_COUNT] = {};
+bool step_high[CHANNEL_COUNT] = {};
+bool dir_high[CHANNEL_COUNT] = {};
+
+// Moves waiting for a device clock time.
+// The stepping ISR starts the move at the first tick after the requested
+// time and flags the new target to be saved.
+int32_t scheduled_target[CHANNEL_COUNT] = {};
+uint32_t scheduled_time[CHANNEL_COUNT] = {};
+bool scheduled[CHANNEL_COUNT] = {};
+
+// Changed targets are flagged to be saved by stepper_update, which keeps
+// EEPROM writes (several ms per byte) out of the ISRs and critical sections.
+// If the supply is monitored (POWER_SENSE_ADC) the positions are instead
+// saved once when the supply fails.
+volatile bool save_pending[CHANNEL_COUNT] = {};
+#ifndef POWER_SENSE_ADC
+static bool save_needed;
+static uint32_t save_time;
+#endif
+
+// Channel state in the newest journal record
+static journal_channel saved[CHANNEL_COUNT];
+
+// Longest delay (us) of the stepping ISR, which is masked by critical
+// sections and other interrupts. This is timed with Timer3, which free-runs
+// at 0.5 us per tick for the 1-wire driver, rather than the device clock, which
+// steps by up to 1 ms when it locks to the USB frames. The 16 bit count
+// wraps after 32 ms, which is much longer than any expected delay.
+#define LATENCY_TICKS_PER_US 2
+static uint16_t last_step_ticks;
+static bool step_timed;
+static volatile uint16_t max_latency_us;
+
+// Save the positions with the compensation offsets that they include
+static void save_positions(const int32_t positions[CHANNEL_COUNT])
+{
+    journal_channel channels[CHANNEL_COUNT];
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        compensation_journal_state(i, &channels[i]);
+        channels[i].position = positions[i];
+    }
+
+    if (!memcmp(channels, saved, sizeof(saved)))
+        return;
+
+    memcpy(saved, channels, sizeof(saved));
+    journal_save(saved);
+}
+
+static uint8_t port_index(volatile uint8_t *port)
+{
+    for (uint8_t i = 0; i < port_count; i++)
+        if (ports[i] == port)
+            return i;
+
+    ports[port_count] = port;
+    return port_count++;
+}
+
+// Returns true if the device clock has reached the given time,
+// allowing for the clock wrapping after ~49 days
+static bool time_reached(uint32_t time)
+{
+    return (int32_t)(clock_millis() - time) >= 0;
+}
+
+void stepper_initialize(void)
+{
+    OCR1A = 4;
+    TCCR1B = _BV(CS12) | _BV(CS10) | _BV(WGM12);
+    TIMSK1 |= _BV(OCIE1A);
+
+    // Earlier firmware saved the positions as dwords at the start of the EEPROM
+    if (!journal_load(saved))
+    {
+        memset(saved, 0, sizeof(saved));
+        for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+            saved[i].position = eeprom_read_dword((uint32_t *)(uintptr_t)(4 * i));
+    }
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        channel *c = &channels[i];
+        gpio_output_set_high(&c->enable);
+        gpio_configure_output(&c->enable);
+
+        gpio_output_set_low(&c->step);
+        gpio_configure_output(&c->step);
+
+        gpio_output_set_low(&c->dir);
+        gpio_configure_output(&c->dir);
+
+        c->enable_port = port_index(c->enable.port);
+        c->step_port = port_index(c->step.port);
+        c->dir_port = port_index(c->dir.port);
+
+        target_steps[i] = current_steps[i] = saved[i].position;
+    }
+}
+
+void stepper_status(uint8_t i, int32_t *target, int32_t *current)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        *target = target_steps[i] >> DOWNSAMPLE_BITS;
+        *current = current_steps[i] >> DOWNSAMPLE_BITS;
+    }
+}
+
+bool stepper_moving(uint8_t i)
+{
+    return enabled[i];
+}
+
+// These may be called from both the command loop and the USB interrupt,
+// so must restore (rather than unconditionally enable) the interrupt state.
+void stepper_set_target(uint8_t i, int32_t target)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduled[i] = false;
+        target_steps[i] = target << DOWNSAMPLE_BITS;
+        save_pending[i] = true;
+    }
+}
+
+// Set a new target that will be applied when the device clock reaches time.
+// This replaces any move that is already scheduled for the channel.
+void stepper_schedule_target(uint8_t i, int32_t target, uint32_t time)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduled_target[i] = target << DOWNSAMPLE_BITS;
+        scheduled_time[i] = time;
+        scheduled[i] = true;
+    }
+}
+
+// Move the target (and any scheduled target) by a relative number of steps.
+// The new target is saved by stepper_update.
+void stepper_offset_target(uint8_t i, int32_t offset)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        target_steps[i] += offset << DOWNSAMPLE_BITS;
+        scheduled_target[i] += offset << DOWNSAMPLE_BITS;
+        save_pending[i] = true;
+    }
+}
+
+// Flag the channel to be saved when its target hasn't changed,
+// e.g. when the compensation offset is first calculated
+void stepper_request_save(uint8_t i)
+{
+    save_pending[i] = true;
+}
+
+void stepper_stop(uint8_t i)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduled[i] = false;
+        target_steps[i] = current_steps[i];
+        save_pending[i] = true;
+    }
+}
+
+void stepper_zero(uint8_t i)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        scheduled[i] = false;
+        target_steps[i] = current_steps[i] = 0;
+        save_pending[i] = true;
+    }
+}
+
+uint16_t stepper_max_latency(void)
+{
+    uint16_t latency;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        latency = max_latency_us;
+    }
+
+    return latency;
+}
+
+// Save the targets of every channel so we can recover
+// the absolute position after a power cycle.
+// Called from the main loop
+void stepper_update(void)
+{
+    // If the supply is monitored the positions are saved by stepper_power_failed instead
+#ifndef POWER_SENSE_ADC
+    bool changed = false;
+    bool moving = false;
+    int32_t targets[CHANNEL_COUNT];
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        {
+            changed |= save_pending[i];
+            save_pending[i] = false;
+            moving |= enabled[i] || current_steps[i] != target_steps[i];
+            targets[i] = target_steps[i];
+        }
+    }
+
+    // Wait for the motors to stop so that a series of moves is saved once,
+    // but don't defer the save indefinitely
+    if (changed && !save_needed)
+    {
+        save_needed = true;
+        save_time = clock_millis() + SAVE_DELAY_MS;
+    }
+
+    if (!save_needed || (moving && !time_reached(save_time)))
+        return;
+
+    save_needed = false;
+    save_positions(targets);
+#endif
+}
+
+// Stop the motors and save their positions before the supply fails completely.
+// The targets and scheduled moves are kept, so the moves continue if the supply returns.
+// Called from the power monitor interrupt, so the EEPROM write can't be interrupted
+void stepper_power_failed(void)
+{
+    // The interrupt may have arrived part way through an EEPROM write from the main
+    // loop (e.g. a configuration or probe slot save), which loads the address and
+    // data registers before it starts the write. Let any write in progress finish,
+    // and restore the registers afterwards so that the main loop's pending byte
+    // goes to its own address rather than over the journal record.
+    eeprom_busy_wait();
+    uint16_t address = EEAR;
+    uint8_t data = EEDR;
+
+    TIMSK1 &= ~_BV(OCIE1A);
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        channel *c = &channels[i];
+        gpio_output_set_high_isr(&c->enable);
+        gpio_output_set_low_isr(&c->step);
+
+        enabled[i] = false;
+        step_high[i] = false;
+    }
+
+    save_positions(current_steps);
+
+    eeprom_busy_wait();
+    EEAR = address;
+    EEDR = data;
+}
+
+// Resume stepping after the supply returns. Motors that still have a move
+// are enabled again on the next tick, and scheduled moves that fell due while
+// the supply was off start immediately.
+void stepper_power_restored(void)
+{
+    step_timed = false;
+    TIMSK1 |= _BV(OCIE1A);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+    uint16_t now_ticks = TCNT3;
+    uint16_t latency_us = (uint16_t)(now_ticks - last_step_ticks) / LATENCY_TICKS_PER_US - STEP_INTERVAL_US;
+    if (step_timed && (int16_t)latency_us > (int16_t)max_latency_us)
+        max_latency_us = latency_us;
+
+    last_step_ticks = now_ticks;
+    step_timed = true;
+
+    // Pins to set and clear on each port
+    uint8_t high[MAX_PORTS] = {};
+    uint8_t low[MAX_PORTS] = {};
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        channel *c = &channels[i];
+        if (scheduled[i] && time_reached(scheduled_time[i]))
+        {
+            scheduled[i] = false;
+            target_steps[i] = scheduled_target[i];
+            save_pending[i] = true;
+        }
+
+        if (!enabled[i] && current_steps[i] != target_steps[i])
+        {
+            enabled[i] = true;
+            step_high[i] = true;
+            high[c->step_port] |= c->step.mask;
+            low[c->enable_port] |= c->enable.mask;
+
+            // Skip a step when enabling a motor to avoid losing a count while it powers up
+        }
+        else if (current_steps[i] != target_steps[i])
+        {
+            bool up = current_steps[i] < target_steps[i];
+            bool change_dir = up != dir_high[i];
+            if (step_high[i])
+            {
+                low[c->step_port] |= c->step.mask;
+                step_high[i] = false;
+            }
+            else if (!change_dir)
+            {
+                high[c->step_port] |= c->step.mask;
+                step_high[i] = true;
+                current_steps[i] += up ? 1 : -1;
+            }
+
+            // The direction only changes with a falling step edge or while the step is low,
+            // so it is set up for a full interrupt period before the next rising edge
+            if (change_dir)
+            {
+                if (up)
+                    high[c->dir_port] |= c->dir.mask;
+                else
+                    low[c->dir_port] |= c->dir.mask;
+
+                dir_high[i] = up;
+            }
+        }
+        else if (enabled[i])
+        {
+            enabled[i] = false;
+            high[c->enable_port] |= c->enable.mask;
+        }
+    }
+
+    for (uint8_t p = 0; p < port_count; p++)
+        if (high[p] | low[p])
+            gpio_port_write(ports[p], high[p], low[p]);
+}
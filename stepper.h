@@ -0,0 +1,32 @@
+//**********************************************************************************
+//  Copyright 2016, 2017, 2022, 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef FOCUSER_STEPPER_H
+#define FOCUSER_STEPPER_H
+
+#if CHANNELS < 1 || CHANNELS > 2
+    #error Only 1 or 2 channels are supported
+#endif
+
+#define CHANNEL_COUNT CHANNELS
+
+// Positions are passed in and out of this module in external (downsampled) units
+void stepper_initialize(void);
+void stepper_status(uint8_t i, int32_t *target, int32_t *current);
+bool stepper_moving(uint8_t i);
+void stepper_set_target(uint8_t i, int32_t target);
+void stepper_schedule_target(uint8_t i, int32_t target, uint32_t time);
+void stepper_offset_target(uint8_t i, int32_t offset);
+void stepper_request_save(uint8_t i);
+void stepper_stop(uint8_t i);
+void stepper_zero(uint8_t i);
+void stepper_update(void);
+uint16_t stepper_max_latency(void);
+void stepper_power_failed(void);
+void stepper_power_restored(void);
+
+#endif
@@ -0,0 +1,640 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <avr/eeprom.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "clock.h"
+#include "config.h"
+#include "ds18b20.h"
+#include "history.h"
+#include "temperature.h"
+#include "usb.h"
+
+// Temperatures are measured in the background from the main loop:
+// a conversion is started on all probes every TEMPERATURE_INTERVAL_MS,
+// and once it has completed the result is read from each probe in turn.
+// The readings from a conversion are published together once every probe has
+// been read, so all cached readings always come from the same conversion.
+// Completion of the conversion is detected by polling the bus, with a timeout
+// set by the highest resolution of the probes being converted. Parasite-powered
+// probes can't hold the bus low while converting, so polling would end the wait
+// immediately. Each search is followed by a Read Power Supply command, and only
+// the timeout is used while any parasite-powered probe is attached.
+// Bus transactions run asynchronously in the onewire engine, so each update
+// only starts a transaction or collects the result of the previous one.
+// Queries are then answered immediately from the cached readings.
+// The probe directory is built by a search at startup and refreshed every
+// RESCAN_INTERVAL_MS between conversions. Probes that appear or disappear
+// are reported to the host as event lines.
+// Each probe is assigned a small index the first time it is seen. The index
+// of each ROM address is saved in EEPROM, so a probe keeps its index across
+// power cycles and being unplugged, unless its slot is needed for a new probe.
+
+// Time between the start of each conversion
+#define TEMPERATURE_INTERVAL_MS 2000
+
+// Time between background searches for added or removed probes
+#define RESCAN_INTERVAL_MS 30000
+
+// Number of times a corrupted search is restarted before waiting for the next rescan
+#define RESCAN_ATTEMPTS 3
+
+// ROM address assigned to each probe index
+// The start of the EEPROM holds the stepper positions saved by earlier firmware
+#define SLOTS_EEPROM_ADDRESS 0x100
+
+enum temperature_state
+{
+    STATE_IDLE,
+    STATE_SEARCHING,
+    STATE_CHECKING_POWER,
+    STATE_CONVERTING,
+    STATE_WAITING,
+    STATE_POLLING,
+    STATE_ALARM_SEARCHING,
+    STATE_READING,
+    STATE_WRITING_CONFIG,
+    STATE_COPYING_CONFIG,
+    STATE_SETTLING
+};
+
+typedef struct
+{
+    uint8_t address[8];
+    uint8_t slot;
+    int16_t reading;
+    uint32_t time;
+    bool valid;
+
+    // TH, TL and configuration registers from the last read
+    uint8_t config[DS18B20_CONFIG_LENGTH];
+    bool config_known;
+
+    // Set when config has been changed and needs to be written to the probe
+    bool config_pending;
+
+    // Set when the probe is to be read after the current conversion
+    bool selected;
+
+    // Set when the alarm search found the probe outside its alarm band
+    bool alarming;
+} probe;
+
+static const gpin_t *onewire_bus;
+static probe probes[TEMPERATURE_MAX_PROBES];
+static uint8_t probe_count;
+
+// Copy of the probe indices stored in EEPROM
+// Unused slots are left erased (0xFF)
+static uint8_t slots[TEMPERATURE_MAX_PROBES][8];
+
+// Directory position of the probe assigned to each slot, or -1
+static int8_t slot_probe[TEMPERATURE_MAX_PROBES];
+
+static uint8_t state = STATE_IDLE;
+static uint32_t conversion_time;
+static uint16_t conversion_timeout;
+static bool parasite_power;
+static uint32_t poll_time;
+static uint32_t copy_time;
+static uint8_t config_index;
+static uint32_t rescan_time;
+static uint8_t rescan_attempts;
+static uint8_t read_index;
+
+// Readings from the conversion that is being read
+static int16_t sweep_readings[TEMPERATURE_MAX_PROBES];
+static bool sweep_valid[TEMPERATURE_MAX_PROBES];
+
+// Start time of the most recent conversion that has been read
+static uint32_t sweep_time;
+
+// Only read probes that are outside their alarm band
+static bool alarm_mode;
+
+// Addresses found by the rescan that is in progress
+static onewire_search_state search;
+static uint8_t found_addresses[TEMPERATURE_MAX_PROBES * 8];
+static uint8_t found_count;
+
+// Number of devices found by the last search that aren't tracked, because they
+// aren't DS18B20s or didn't fit in the table
+static uint8_t ignored_count;
+
+static int8_t find_probe(const uint8_t address[8])
+{
+    for (uint8_t i = 0; i < probe_count; i++)
+        if (!memcmp(probes[i].address, address, 8))
+            return i;
+
+    return -1;
+}
+
+static bool slot_empty(uint8_t slot)
+{
+    // The family code is never 0xFF for a real device
+    return slots[slot][0] == 0xFF;
+}
+
+static int8_t find_slot(const uint8_t address[8])
+{
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+        if (!memcmp(slots[i], address, 8))
+            return i;
+
+    return -1;
+}
+
+// Assign the first empty slot to a new probe, or reuse the first slot
+// that doesn't belong to any of the probes found by the search
+static void assign_slot(probe *p)
+{
+    int8_t slot = -1;
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES && slot < 0; i++)
+        if (slot_empty(i))
+            slot = i;
+
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES && slot < 0; i++)
+    {
+        bool used = false;
+        for (uint8_t j = 0; j < found_count; j++)
+            if (!memcmp(slots[i], &found_addresses[j * 8], 8))
+                used = true;
+
+        if (!used)
+            slot = i;
+    }
+
+    // There are never more present probes than slots
+    p->slot = slot;
+    memcpy(slots[slot], p->address, 8);
+    eeprom_update_block(slots[slot], (void *)(uintptr_t)(SLOTS_EEPROM_ADDRESS + 8 * slot), 8);
+}
+
+// Notify the host of a reading from a probe that is outside its alarm band
+static void send_alarm_event(const probe *p)
+{
+    char temp[10];
+    char event[40];
+    ds18b20_format(p->reading, temp);
+    sprintf(event, "*A%d=%s,T=%" PRIu32 "\r\n", p->slot + 1, temp, p->time);
+    usb_write_data(event, strlen(event));
+}
+
+// Notify the host that a probe has been added ('+') or removed ('-')
+static void send_probe_event(char change, const probe *p)
+{
+    const uint8_t *address = p->address;
+    char event[40];
+    char *e = event + sprintf(event, "*P%c%d=", change, p->slot + 1);
+    for (uint8_t j = 0; j < 8; j++)
+        e += sprintf(e, "%02X", address[j]);
+    sprintf(e, ",T=%" PRIu32 "\r\n", clock_millis());
+    usb_write_data(event, strlen(event));
+}
+
+// (Re)start the search, discarding the addresses found so far
+static void restart_search(void)
+{
+    found_count = 0;
+    ignored_count = 0;
+    ds18b20_search_begin(&search);
+    state = ds18b20_start_search(&search) ? STATE_SEARCHING : STATE_IDLE;
+}
+
+// Start a search for the probes on the bus
+static void start_rescan(void)
+{
+    rescan_time = clock_millis();
+    rescan_attempts = 1;
+    restart_search();
+}
+
+// Update the probe table in place with the devices that were found by the search.
+// Cached readings are kept for probes that are still present.
+static void finish_rescan(void)
+{
+    // Remove probes that are no longer present
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        bool present = false;
+        for (uint8_t j = 0; j < found_count; j++)
+            if (!memcmp(probes[i].address, &found_addresses[j * 8], 8))
+                present = true;
+
+        if (!present)
+            send_probe_event('-', &probes[i]);
+        else if (kept++ != i)
+            probes[kept - 1] = probes[i];
+    }
+
+    probe_count = kept;
+
+    // Add new probes to the end of the table
+    for (uint8_t i = 0; i < found_count; i++)
+    {
+        const uint8_t *address = &found_addresses[i * 8];
+        if (find_probe(address) >= 0)
+            continue;
+
+        probe *p = &probes[probe_count++];
+        memset(p, 0, sizeof(probe));
+        memcpy(p->address, address, 8);
+
+        int8_t slot = find_slot(address);
+        if (slot >= 0)
+            p->slot = slot;
+        else
+            assign_slot(p);
+
+        send_probe_event('+', p);
+    }
+
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+    {
+        slot_probe[i] = -1;
+        usb_status_set_temperature(i, USB_STATUS_TEMPERATURE_UNKNOWN);
+    }
+
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        slot_probe[probes[i].slot] = i;
+        if (probes[i].valid)
+            usb_status_set_temperature(probes[i].slot, probes[i].reading);
+    }
+}
+
+// Start a conversion on all probes
+static void start_conversion(uint32_t now)
+{
+    // Probes default to 12 bits until their configuration has been read
+    uint8_t resolution = DS18B20_MIN_RESOLUTION;
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        uint8_t bits = probes[i].config_known ? ds18b20_resolution(probes[i].config) : DS18B20_MAX_RESOLUTION;
+        if (bits > resolution)
+            resolution = bits;
+    }
+
+    // In alarm mode probes are only read if the alarm search selects them,
+    // or to fetch their first reading and configuration
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        probes[i].selected = !alarm_mode || !probes[i].valid || !probes[i].config_known;
+        probes[i].alarming = false;
+    }
+
+    // Temperature compensation filters every reading of its probe, so these
+    // are always read even while they are inside their alarm band
+    config_data *config = config_get();
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        int8_t i = temperature_find_index(config->compensation[j].probe);
+        if (i >= 0)
+            probes[i].selected = true;
+    }
+
+    conversion_time = now;
+    conversion_timeout = ds18b20_conversion_time(resolution);
+    if (ds18b20_start_convert())
+        state = STATE_CONVERTING;
+}
+
+// Start writing the configuration to the first probe that has a pending change
+static bool start_config_write(void)
+{
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        if (!probes[i].config_pending)
+            continue;
+
+        if (ds18b20_start_write_config(probes[i].address, probes[i].config))
+        {
+            config_index = i;
+            state = STATE_WRITING_CONFIG;
+        }
+        else
+            probes[i].config_pending = false;
+
+        return true;
+    }
+
+    return false;
+}
+
+// Publish the readings from the conversion once every probe has been read
+// Probes that weren't selected keep their previous reading
+static void finish_sweep(void)
+{
+    int16_t readings[TEMPERATURE_MAX_PROBES];
+    for (uint8_t i = 0; i < TEMPERATURE_MAX_PROBES; i++)
+        readings[i] = HISTORY_READING_UNKNOWN;
+
+    for (uint8_t i = 0; i < probe_count; i++)
+    {
+        probe *p = &probes[i];
+        if (!p->selected)
+            continue;
+
+        p->valid = sweep_valid[i];
+        p->reading = sweep_readings[i];
+        p->time = conversion_time;
+        usb_status_set_temperature(p->slot, p->valid ? p->reading : USB_STATUS_TEMPERATURE_UNKNOWN);
+
+        if (p->valid)
+        {
+            readings[p->slot] = p->reading;
+            if (p->alarming)
+                send_alarm_event(p);
+        }
+    }
+
+    sweep_time = conversion_time;
+    history_record(conversion_time, readings);
+}
+
+static void read_next_probe(void);
+
+// Select the probes to read after a conversion has completed
+static void start_readout(void)
+{
+    read_index = 0;
+    if (alarm_mode)
+    {
+        // Probes that are outside their alarm band respond to the alarm search
+        ds18b20_search_begin(&search);
+        if (ds18b20_start_alarm_search(&search))
+        {
+            state = STATE_ALARM_SEARCHING;
+            return;
+        }
+    }
+
+    read_next_probe();
+}
+
+// Start reading the next probe, or return to idle once they have all been read
+static void read_next_probe(void)
+{
+    while (read_index < probe_count)
+    {
+        if (!probes[read_index].selected)
+        {
+            read_index++;
+            continue;
+        }
+
+        if (ds18b20_start_read(probes[read_index].address))
+        {
+            state = STATE_READING;
+            return;
+        }
+
+        sweep_valid[read_index++] = false;
+    }
+
+    finish_sweep();
+    state = STATE_IDLE;
+}
+
+void temperature_initialize(const gpin_t *bus)
+{
+    onewire_bus = bus;
+    alarm_mode = config_get()->alarm_mode;
+    eeprom_read_block(slots, (const void *)SLOTS_EEPROM_ADDRESS, sizeof(slots));
+    memset(slot_probe, -1, sizeof(slot_probe));
+    ds18b20_initialize(onewire_bus);
+    start_rescan();
+}
+
+const uint8_t *temperature_probe_address(uint8_t i)
+{
+    return probes[i].address;
+}
+
+// Returns the directory position of the probe with the given address, or -1 if it is unknown
+int8_t temperature_find_address(const uint8_t address[8])
+{
+    return find_probe(address);
+}
+
+// Returns the directory position of the probe with the given 1-based index, or -1 if it is unknown
+int8_t temperature_find_index(uint8_t index)
+{
+    if (index < 1 || index > TEMPERATURE_MAX_PROBES)
+        return -1;
+
+    return slot_probe[index - 1];
+}
+
+// Returns the number of devices that were ignored by the last search because they
+// aren't DS18B20s or the table was full
+uint8_t temperature_ignored_count(void)
+{
+    return ignored_count;
+}
+
+// Returns the most recent reading for probe i and the device time of its conversion,
+// or false if the probe is unknown or its last read failed.
+bool temperature_reading(int8_t i, int16_t *reading, uint32_t *time)
+{
+    if (i < 0 || i >= probe_count || !probes[i].valid)
+        return false;
+
+    *reading = probes[i].reading;
+    *time = probes[i].time;
+    return true;
+}
+
+// Returns the most recent reading for probe i (in directory order),
+// or false if it has not been measured yet or its last read failed.
+bool temperature_probe_reading(uint8_t i, int16_t *reading)
+{
+    if (i >= probe_count || !probes[i].valid)
+        return false;
+
+    *reading = probes[i].reading;
+    return true;
+}
+
+// Device time that the most recent conversion was started
+uint32_t temperature_sweep_time(void)
+{
+    return sweep_time;
+}
+
+// Set the alarm band (whole degrees C) of probe i, which is written to the probe and its EEPROM in the background.
+// Returns false if the probe is unknown or its configuration hasn't been read yet.
+bool temperature_set_alarm(int8_t i, int8_t low, int8_t high)
+{
+    if (i < 0 || i >= probe_count || !probes[i].config_known || low > high)
+        return false;
+
+    ds18b20_set_alarm(probes[i].config, low, high);
+    probes[i].config_pending = true;
+    return true;
+}
+
+// Returns the alarm band (whole degrees C) of probe i, or false if it is unknown
+bool temperature_alarm(int8_t i, int8_t *low, int8_t *high)
+{
+    if (i < 0 || i >= probe_count || !probes[i].config_known)
+        return false;
+
+    ds18b20_alarm(probes[i].config, low, high);
+    return true;
+}
+
+// Enable or disable reading only the probes that are outside their alarm band
+// The mode is kept after a power cycle once the configuration is saved
+void temperature_set_alarm_mode(bool enabled)
+{
+    alarm_mode = enabled;
+    config_get()->alarm_mode = enabled;
+}
+
+bool temperature_alarm_mode(void)
+{
+    return alarm_mode;
+}
+
+// Set the resolution of probe i, which is written to the probe and its EEPROM in the background.
+// Returns false if the probe is unknown, its configuration hasn't been read yet, or bits is out of range.
+bool temperature_set_resolution(int8_t i, uint8_t bits)
+{
+    if (i < 0 || i >= probe_count || !probes[i].config_known || bits < DS18B20_MIN_RESOLUTION || bits > DS18B20_MAX_RESOLUTION)
+        return false;
+
+    ds18b20_set_resolution(probes[i].config, bits);
+    probes[i].config_pending = true;
+    return true;
+}
+
+// Advance the background measurement by at most one bus transaction
+// Called from the main loop
+void temperature_update(void)
+{
+    // Wait for the current transaction to complete
+    if (ds18b20_busy())
+        return;
+
+    uint32_t now = clock_millis();
+    switch (state)
+    {
+        case STATE_IDLE:
+            if (start_config_write())
+                break;
+
+            if (now - rescan_time >= RESCAN_INTERVAL_MS)
+                start_rescan();
+            else if (probe_count && now - conversion_time >= TEMPERATURE_INTERVAL_MS)
+                start_conversion(now);
+            break;
+        case STATE_SEARCHING:
+            if (ds18b20_search_failed(&search))
+            {
+                // The probes after the failed step weren't reached, so finishing the rescan
+                // would report them as removed. Keep the existing directory and try again.
+                if (rescan_attempts++ < RESCAN_ATTEMPTS)
+                    restart_search();
+                else
+                    state = STATE_IDLE;
+                break;
+            }
+
+            if (ds18b20_finish_search(&search))
+            {
+                // Other 1-wire devices may share the bus, but can't be read as probes
+                if (search.address[0] == DS18B20_FAMILY_CODE && found_count < TEMPERATURE_MAX_PROBES)
+                    memcpy(&found_addresses[8 * found_count++], search.address, 8);
+                else if (ignored_count < UINT8_MAX)
+                    ignored_count++;
+            }
+
+            // The search ends when there are no more devices, or no devices responded to the reset
+            if (!ds18b20_start_search(&search))
+            {
+                finish_rescan();
+                state = probe_count && ds18b20_start_read_power() ? STATE_CHECKING_POWER : STATE_IDLE;
+            }
+            break;
+        case STATE_CHECKING_POWER:
+            // Keep the previous answer if the probes didn't respond
+            ds18b20_finish_read_power(&parasite_power);
+            state = STATE_IDLE;
+            break;
+        case STATE_CONVERTING:
+            state = ds18b20_finish_convert() ? STATE_WAITING : STATE_IDLE;
+            break;
+        case STATE_WAITING:
+            if (now - conversion_time >= conversion_timeout)
+                start_readout();
+            else if (!parasite_power && now != poll_time && ds18b20_start_poll())
+            {
+                // Poll at most once per millisecond
+                poll_time = now;
+                state = STATE_POLLING;
+            }
+            break;
+        case STATE_POLLING:
+            if (ds18b20_finish_poll())
+                start_readout();
+            else
+                state = STATE_WAITING;
+            break;
+        case STATE_ALARM_SEARCHING:
+            if (ds18b20_finish_search(&search))
+            {
+                int8_t i = find_probe(search.address);
+                if (i >= 0)
+                    probes[i].selected = probes[i].alarming = true;
+            }
+
+            // The search ends when there are no more alarming devices
+            if (!ds18b20_start_alarm_search(&search))
+                read_next_probe();
+            break;
+        case STATE_READING:
+        {
+            probe *p = &probes[read_index];
+            uint8_t config[DS18B20_CONFIG_LENGTH];
+            sweep_valid[read_index] = ds18b20_finish_read(&sweep_readings[read_index], config);
+
+            // Don't overwrite a change that hasn't been written yet
+            if (sweep_valid[read_index] && !p->config_pending)
+            {
+                memcpy(p->config, config, DS18B20_CONFIG_LENGTH);
+                p->config_known = true;
+            }
+
+            read_index++;
+            read_next_probe();
+            break;
+        }
+        case STATE_WRITING_CONFIG:
+            if (ds18b20_finish_config() && ds18b20_start_copy_config(probes[config_index].address))
+                state = STATE_COPYING_CONFIG;
+            else
+            {
+                probes[config_index].config_pending = false;
+                state = STATE_IDLE;
+            }
+            break;
+        case STATE_COPYING_CONFIG:
+            // The bus must stay idle while the probe writes its EEPROM
+            probes[config_index].config_pending = false;
+            copy_time = now;
+            state = STATE_SETTLING;
+            break;
+        case STATE_SETTLING:
+            if (now - copy_time > DS18B20_COPY_TIME_MS)
+                state = STATE_IDLE;
+            break;
+    }
+}
@@ -0,0 +1,35 @@
+//**********************************************************************************
+//  Copyright 2023 Paul Chote, All Rights Reserved
+//**********************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "gpio.h"
+
+#ifndef FOCUSER_TEMPERATURE_H
+#define FOCUSER_TEMPERATURE_H
+
+#if PROBES < 1 || PROBES > 16
+    #error Only 1 to 16 temperature probes are supported
+#endif
+
+// Maximum number of probes that are tracked
+
+#define TEMPERATURE_MAX_PROBES PROBES
+
+void temperature_initialize(const gpin_t *bus);
+void temperature_update(void);
+const uint8_t *temperature_probe_address(uint8_t i);
+int8_t temperature_find_address(const uint8_t address[8]);
+int8_t temperature_find_index(uint8_t index);
+uint8_t temperature_ignored_count(void);
+bool temperature_reading(int8_t i, int16_t *reading, uint32_t *time);
+bool temperature_probe_reading(uint8_t i, int16_t *reading);
+uint32_t temperature_sweep_time(void);
+bool temperature_set_resolution(int8_t i, uint8_t bits);
+bool temperature_set_alarm(int8_t i, int8_t low, int8_t high);
+bool temperature_alarm(int8_t i, int8_t *low, int8_t *high);
+void temperature_set_alarm_mode(bool enabled);
+bool temperature_alarm_mode(void);
+
+#endif
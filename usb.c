@@ -4,12 +4,16 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Common/Common.h>
 #include "usb_descriptors.h"
+#include "clock.h"
 #include "gpio.h"
+#include "stepper.h"
+#include "usb.h"
 
 USB_ClassInfo_CDC_Device_t interface =
 {
@@ -20,13 +24,13 @@ USB_ClassInfo_CDC_Device_t interface =
         {
             .Address            = CDC_TX_EPADDR,
             .Size               = CDC_TXRX_EPSIZE,
-            .Banks              = 1,
+            .Banks              = 2,
         },
         .DataOUTEndpoint        =
         {
             .Address            = CDC_RX_EPADDR,
             .Size               = CDC_TXRX_EPSIZE,
-            .Banks              = 1,
+            .Banks              = 2,
         },
         .NotificationEndpoint   =
         {
@@ -37,6 +41,32 @@ USB_ClassInfo_CDC_Device_t interface =
     },
 };
 
+// Responses are queued in a ring buffer and sent from the start of frame event,
+// so that several short responses can share a single USB packet.
+// The size must be a power of two no larger than 128.
+#define TX_BUFFER_SIZE 128
+#define TX_BUFFER_MASK (TX_BUFFER_SIZE - 1)
+
+static uint8_t tx_buffer[TX_BUFFER_SIZE];
+static volatile uint8_t tx_head;
+static volatile uint8_t tx_tail;
+static bool tx_zlp_pending;
+static uint16_t tx_overflows;
+
+// Streamed responses are written a piece at a time from the main loop as the
+// host makes space. The rest of the response is dropped if the host doesn't
+// make space for the next piece within TX_STREAM_TIMEOUT_MS.
+#define TX_STREAM_TIMEOUT_MS 10
+static bool tx_streaming;
+static bool tx_stream_failed;
+static bool tx_stream_waiting;
+static uint32_t tx_stream_wait_start;
+
+// Positions are refreshed in the status report at the start of each frame,
+// but the fan status and temperatures are only updated when they change.
+static usb_status_report status_report;
+_Static_assert(sizeof(usb_status_report) <= STATUS_EPSIZE, "status report must fit in a single packet");
+
 // Counters (in milliseconds) for blinking the TX/RX LEDs
 #define TX_RX_LED_PULSE_MS 100
 
@@ -61,70 +91,477 @@ void usb_initialize(gpin_t *usb_conn_led, gpin_t *usb_rx_led, gpin_t *usb_tx_led
     gpio_configure_output(tx_led);
     gpio_output_set_low(tx_led);
 
+    for (uint8_t i = 0; i < USB_STATUS_TEMPERATURE_COUNT; i++)
+        status_report.temperatures[i] = USB_STATUS_TEMPERATURE_UNKNOWN;
+
     USB_Init();
 }
 
-bool usb_can_read(void)
+// Received bytes are copied a whole endpoint bank at a time into a ring buffer
+// from the start of frame interrupt, so data keeps flowing while the command
+// loop is busy. Command lines are handed to the parser in place rather than
+// byte by byte.
+// The size must be a power of two no larger than 128 so that the free-running
+// uint8_t indices can describe a full buffer.
+#define RX_BUFFER_SIZE 128
+#define RX_BUFFER_MASK (RX_BUFFER_SIZE - 1)
+
+static char rx_buffer[RX_BUFFER_SIZE];
+static volatile uint8_t rx_head;
+static volatile uint8_t rx_tail;
+
+// Number of bytes after rx_head that are known not to contain a terminator
+static uint8_t rx_scanned;
+
+// Length of the line returned by the last call to usb_read_line
+static uint8_t rx_line_length;
+
+// Longest command line (excluding the terminator) that is accepted wherever it
+// falls in the ring. The start of a longer line is dropped as soon as it is seen,
+// so an unterminated line never holds more than this and there is always space
+// for the next endpoint bank once the complete lines have been parsed.
+#define RX_MAX_LINE_LENGTH 63
+_Static_assert(RX_BUFFER_SIZE - (RX_MAX_LINE_LENGTH + 1) >= CDC_TXRX_EPSIZE, "receive buffer must hold a full line and an endpoint bank");
+
+// Set while skipping the remainder of a line that is too long
+static bool rx_discarding;
+
+// Lines that wrap around the end of the ring are copied here so that
+// the parser always sees a contiguous null-terminated string
+static char rx_line[RX_MAX_LINE_LENGTH + 1];
+
+// Stop commands ([1..9]S) are acted on as soon as they are received,
+// without waiting for the command loop. The command loop still parses
+// and acknowledges them later, which repeats the (idempotent) stop.
+// Moves for the channel that were received before the stop but are still
+// waiting for the command loop are discarded (see usb_line_stopped).
+// rx_stop_index is the ring index after the last byte received before the stop,
+// and is cleared once the command loop has passed it.
+static volatile bool rx_stop_pending[CHANNEL_COUNT];
+static volatile uint8_t rx_stop_index[CHANNEL_COUNT];
+
+enum priority_state
+{
+    PRIORITY_LINE_START,
+    PRIORITY_CHANNEL,
+    PRIORITY_STOP,
+    PRIORITY_IGNORE
+};
+
+static uint8_t priority_state;
+static uint8_t priority_channel;
+
+// Called from the USB interrupts
+static void priority_stop(uint8_t channel, uint8_t index)
+{
+    stepper_stop(channel);
+    rx_stop_pending[channel] = true;
+    rx_stop_index[channel] = index;
+}
+
+static void scan_priority_commands(uint8_t start, uint8_t length)
+{
+    for (uint8_t i = 0; i < length; i++)
+    {
+        char c = rx_buffer[(uint8_t)(start + i) & RX_BUFFER_MASK];
+        if (c == '\r' || c == '\n')
+        {
+            if (priority_state == PRIORITY_STOP)
+                priority_stop(priority_channel, start + i + 1);
+
+            priority_state = PRIORITY_LINE_START;
+            continue;
+        }
+
+        switch (priority_state)
+        {
+            case PRIORITY_LINE_START:
+                if (c > '0' && c <= '0' + CHANNEL_COUNT)
+                {
+                    priority_channel = c - '1';
+                    priority_state = PRIORITY_CHANNEL;
+                }
+                else
+                    priority_state = PRIORITY_IGNORE;
+                break;
+            case PRIORITY_CHANNEL:
+                priority_state = c == 'S' ? PRIORITY_STOP : PRIORITY_IGNORE;
+                break;
+            default:
+                priority_state = PRIORITY_IGNORE;
+                break;
+        }
+    }
+}
+
+// Copy any data waiting in the OUT endpoint into the receive buffer
+// Called from the start of frame interrupt
+static void receive_endpoint(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured || !interface.State.LineEncoding.BaudRateBPS)
+        return;
+
+    uint8_t previous = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(CDC_RX_EPADDR);
+
+    if (Endpoint_IsOUTReceived())
+    {
+        uint8_t length = Endpoint_BytesInEndpoint();
+
+        // Leave the bank in the endpoint (NAKing the host) until the parser has freed enough space
+        if (length <= (uint8_t)(RX_BUFFER_SIZE - (uint8_t)(rx_tail - rx_head)))
+        {
+            uint8_t offset = rx_tail & RX_BUFFER_MASK;
+            uint8_t chunk = RX_BUFFER_SIZE - offset;
+            if (chunk > length)
+                chunk = length;
+
+            if (chunk)
+                Endpoint_Read_Stream_LE(&rx_buffer[offset], chunk, NULL);
+            if (length > chunk)
+                Endpoint_Read_Stream_LE(rx_buffer, length - chunk, NULL);
+
+            Endpoint_ClearOUT();
+            scan_priority_commands(rx_tail, length);
+            rx_tail += length;
+
+            // Flash the RX LED
+            if (length)
+            {
+                gpio_output_set_high_isr(rx_led);
+                rx_led_pulse = TX_RX_LED_PULSE_MS;
+            }
+        }
+    }
+
+    Endpoint_SelectEndpoint(previous);
+}
+
+// Free receive buffer space, and forget the stops that the command loop has passed.
+// Each call advances by at most RX_MAX_LINE_LENGTH + 1, so the stop indices are
+// never more than half the index range behind.
+static void rx_advance(uint8_t length)
 {
-    return CDC_Device_BytesReceived(&interface) > 0;
+    rx_head += length;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+            if (rx_stop_pending[i] && (int8_t)(rx_head - rx_stop_index[i]) >= 0)
+                rx_stop_pending[i] = false;
+    }
 }
 
-// Read a byte from the receive buffer
-// Will return negative if unable to read
-int16_t usb_read(void)
+// Find the next complete line in the receive buffer.
+// Returns its length and points line at a null-terminated copy,
+// or returns -1 if no complete line is available.
+// Empty lines are skipped, and lines longer than RX_MAX_LINE_LENGTH are
+// returned with zero length so that the caller can reject them.
+// The line must be released with usb_release_line once it has been handled.
+int16_t usb_read_line(char **line)
 {
-    int16_t ret = CDC_Device_ReceiveByte(&interface);
+    // Commands wait for a streamed response to finish so that responses stay in order
+    if (tx_streaming)
+        return -1;
 
-    // Flash the RX LED
-    if (ret >= 0)
+    uint8_t available = rx_tail - rx_head;
+    while (rx_scanned < available)
     {
-        gpio_output_set_high(rx_led);
-        rx_led_pulse = TX_RX_LED_PULSE_MS;
-        USB_Device_EnableSOFEvents();
+        char *c = &rx_buffer[(uint8_t)(rx_head + rx_scanned) & RX_BUFFER_MASK];
+        if (*c != '\r' && *c != '\n')
+        {
+            rx_scanned++;
+
+            // Drop the start of a line that is too long, and skip
+            // the rest of it until the terminator arrives
+            if (rx_scanned > RX_MAX_LINE_LENGTH)
+            {
+                rx_advance(rx_scanned);
+                available -= rx_scanned;
+                rx_scanned = 0;
+                rx_discarding = true;
+            }
+
+            continue;
+        }
+
+        if (rx_discarding)
+        {
+            rx_discarding = false;
+            rx_line[0] = '\0';
+            rx_line_length = rx_scanned;
+            *line = rx_line;
+            return 0;
+        }
+
+        if (rx_scanned == 0)
+        {
+            // Skip the terminator of an empty line
+            rx_advance(1);
+            available--;
+            continue;
+        }
+
+        rx_line_length = rx_scanned;
+        uint8_t start = rx_head & RX_BUFFER_MASK;
+        if (start + rx_line_length < RX_BUFFER_SIZE)
+        {
+            // Parse in place, reusing the terminator as the null byte
+            *c = '\0';
+            *line = &rx_buffer[start];
+            return rx_line_length;
+        }
+
+        // The line wraps around the end of the buffer
+        for (uint8_t i = 0; i < rx_line_length; i++)
+            rx_line[i] = rx_buffer[(uint8_t)(rx_head + i) & RX_BUFFER_MASK];
+        rx_line[rx_line_length] = '\0';
+        *line = rx_line;
+        return rx_line_length;
+    }
+
+    return -1;
+}
+
+// Free the buffer space used by the line returned from usb_read_line
+void usb_release_line(void)
+{
+    rx_advance(rx_line_length + 1);
+    rx_scanned = 0;
+    rx_line_length = 0;
+}
+
+// Returns true if a stop for the channel was received after the line returned
+// from usb_read_line, so that a move in the line should be discarded
+bool usb_line_stopped(uint8_t channel)
+{
+    uint8_t end = rx_head + rx_line_length + 1;
+    bool stopped;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        stopped = rx_stop_pending[channel] && (int8_t)(rx_stop_index[channel] - end) >= 0;
+    }
+
+    return stopped;
+}
+
+// Write a buffer to the IN endpoint, splitting it into at most two
+// contiguous chunks around the end of the transmit ring
+static void write_endpoint(uint8_t offset, uint8_t length)
+{
+    uint8_t chunk = TX_BUFFER_SIZE - offset;
+    if (chunk > length)
+        chunk = length;
+
+    if (chunk)
+        Endpoint_Write_Stream_LE(&tx_buffer[offset], chunk, NULL);
+    if (length > chunk)
+        Endpoint_Write_Stream_LE(tx_buffer, length - chunk, NULL);
+}
+
+// Move queued data from the transmit buffer into any free IN endpoint banks.
+// Must be called with interrupts disabled.
+static void flush_tx(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return;
+
+    uint8_t previous = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(CDC_TX_EPADDR);
+
+    while (Endpoint_IsINReady())
+    {
+        uint8_t length = tx_tail - tx_head;
+        if (!length && !tx_zlp_pending)
+            break;
+
+        if (length > CDC_TXRX_EPSIZE)
+            length = CDC_TXRX_EPSIZE;
+
+        write_endpoint(tx_head & TX_BUFFER_MASK, length);
+        Endpoint_ClearIN();
+        tx_head += length;
+
+        // The host treats a full packet as the middle of a transfer,
+        // so follow it with an empty packet if nothing else is queued
+        tx_zlp_pending = length == CDC_TXRX_EPSIZE;
+
+        // Flash the TX LED
+        if (length)
+        {
+            gpio_output_set_high_isr(tx_led);
+            tx_led_pulse = TX_RX_LED_PULSE_MS;
+        }
     }
 
-    return ret;
+    Endpoint_SelectEndpoint(previous);
 }
 
 // Add a byte to the send buffer.
-// Will block if the buffer is full
 void usb_write(uint8_t b)
 {
-    // Note: This is ignoring any errors (e.g. send failed)
-    // We are only sending single byte packets, so there's no
-    // real benefits to handling them properly
-    if (CDC_Device_SendByte(&interface, b) != ENDPOINT_READYWAIT_NoError)
-        return;
+    usb_write_data(&b, 1);
+}
 
-    if (CDC_Device_Flush(&interface) != ENDPOINT_READYWAIT_NoError)
+// Add data to the send buffer, which is transmitted on the next USB frame.
+// Never blocks: if the host isn't reading and there is not enough space
+// for the whole message then it is dropped and counted as an overflow.
+void usb_write_data(void *buf, uint16_t len)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
         return;
 
-    // Flash the TX LED
-    gpio_output_set_high(tx_led);
-    tx_led_pulse = TX_RX_LED_PULSE_MS;
-    USB_Device_EnableSOFEvents();
+    uint8_t free = TX_BUFFER_SIZE - (uint8_t)(tx_tail - tx_head);
+    if (len > free)
+    {
+        // Try to make space by moving data into a free endpoint bank
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            flush_tx();
+        }
+
+        free = TX_BUFFER_SIZE - (uint8_t)(tx_tail - tx_head);
+        if (len > free)
+        {
+            if (tx_overflows < UINT16_MAX)
+                tx_overflows++;
+            return;
+        }
+    }
+
+    uint8_t *data = buf;
+    for (uint8_t i = 0; i < len; i++)
+        tx_buffer[(uint8_t)(tx_tail + i) & TX_BUFFER_MASK] = data[i];
+
+    tx_tail += len;
 }
 
-void usb_write_data(void *buf, uint16_t len)
+// Start a response that is written in pieces with usb_stream_write.
+// This is used for responses that may be longer than the send buffer.
+// usb_read_line doesn't return any more commands until usb_stream_end.
+void usb_stream_begin(void)
+{
+    tx_streaming = true;
+    tx_stream_failed = false;
+    tx_stream_waiting = false;
+}
+
+void usb_stream_end(void)
+{
+    tx_streaming = false;
+}
+
+// Add part of a streamed response to the send buffer.
+// Never blocks: returns false if there isn't space yet, and the caller should
+// write the same part again on a later pass of the main loop. If the host stops
+// reading then the rest of the response is dropped (returning true) and counted
+// as an overflow.
+bool usb_stream_write(const void *buf, uint8_t len)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured || tx_stream_failed)
+        return true;
+
+    if ((uint8_t)(TX_BUFFER_SIZE - (uint8_t)(tx_tail - tx_head)) < len)
+    {
+        if (!tx_stream_waiting)
+        {
+            tx_stream_waiting = true;
+            tx_stream_wait_start = clock_millis();
+        }
+        else if (clock_millis() - tx_stream_wait_start > TX_STREAM_TIMEOUT_MS)
+        {
+            tx_stream_failed = true;
+            if (tx_overflows < UINT16_MAX)
+                tx_overflows++;
+            return true;
+        }
+
+        return false;
+    }
+
+    tx_stream_waiting = false;
+    const uint8_t *data = buf;
+    for (uint8_t i = 0; i < len; i++)
+        tx_buffer[(uint8_t)(tx_tail + i) & TX_BUFFER_MASK] = data[i];
+
+    tx_tail += len;
+    return true;
+}
+
+// Number of messages that have been dropped because the send buffer was full
+uint16_t usb_tx_overflows(void)
+{
+    return tx_overflows;
+}
+
+// The 11-bit frame number of the most recent SOF packet
+uint16_t usb_frame_number(void)
+{
+    return USB_Device_GetFrameNumber();
+}
+
+void usb_status_set_fans(bool enabled)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (enabled)
+            status_report.flags |= USB_STATUS_FLAG_FANS_ENABLED;
+        else
+            status_report.flags &= ~USB_STATUS_FLAG_FANS_ENABLED;
+    }
+}
+
+void usb_status_set_temperature(uint8_t i, int16_t reading)
 {
-    // Note: This is ignoring any errors (e.g. send failed)
-    // We are only sending single byte packets, so there's no
-    // real benefits to handling them properly
-    if (CDC_Device_SendData(&interface, buf, len) != ENDPOINT_READYWAIT_NoError)
+    if (i >= USB_STATUS_TEMPERATURE_COUNT)
         return;
 
-    if (CDC_Device_Flush(&interface) != ENDPOINT_READYWAIT_NoError)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        status_report.temperatures[i] = reading;
+    }
+}
+
+// Refresh the status report and queue it on the interrupt endpoint.
+// The host polls every frame, so the bank is normally free by the next SOF.
+static void send_status_report(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
         return;
 
-    // Flash the TX LED
-    gpio_output_set_high(tx_led);
-    tx_led_pulse = TX_RX_LED_PULSE_MS;
-    USB_Device_EnableSOFEvents();
+    uint8_t previous = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(STATUS_EPADDR);
+
+    if (Endpoint_IsINReady())
+    {
+        status_report.time = clock_millis();
+        for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        {
+            int32_t target, current;
+            stepper_status(i, &target, &current);
+            status_report.channels[i].target = target;
+            status_report.channels[i].current = current;
+
+            if (stepper_moving(i))
+                status_report.flags |= _BV(i);
+            else
+                status_report.flags &= ~_BV(i);
+        }
+
+        Endpoint_Write_Stream_LE(&status_report, sizeof(status_report), NULL);
+        Endpoint_ClearIN();
+    }
+
+    Endpoint_SelectEndpoint(previous);
 }
 
 void EVENT_USB_Device_ConfigurationChanged(void)
 {
     CDC_Device_ConfigureEndpoints(&interface);
+    Endpoint_ConfigureEndpoint(STATUS_EPADDR, EP_TYPE_INTERRUPT, STATUS_EPSIZE, 1);
+
+    // The SOF event sends queued data and the status report
+    // so must run every frame while the device is configured
+    USB_Device_EnableSOFEvents();
 }
 
 void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
@@ -148,21 +585,119 @@ void EVENT_USB_Device_Disconnect(void)
     gpio_output_set_low(rx_led);
 }
 
+static bool valid_target(int32_t target)
+{
+    return target >= -USB_VENDOR_TARGET_LIMIT && target <= USB_VENDOR_TARGET_LIMIT;
+}
+
+// Handle a request addressed to the vendor-specific interface.
+// Requests that are not handled here are stalled by the USB library.
+static void process_vendor_request(void)
+{
+    uint8_t i = USB_ControlRequest.wValue;
+
+    switch (USB_ControlRequest.bRequest)
+    {
+        case USB_VENDOR_REQUEST_GET_STATUS:
+            if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_INTERFACE))
+            {
+                usb_vendor_status status = {
+                    .time = clock_millis(),
+                    .channel_count = CHANNEL_COUNT
+                };
+                for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+                {
+                    int32_t target, current;
+                    stepper_status(j, &target, &current);
+                    status.channels[j].target = target;
+                    status.channels[j].current = current;
+                }
+
+                Endpoint_ClearSETUP();
+                Endpoint_Write_Control_Stream_LE(&status, sizeof(status));
+                Endpoint_ClearOUT();
+            }
+
+            break;
+        case USB_VENDOR_REQUEST_SET_TARGET:
+            if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_INTERFACE) &&
+                USB_ControlRequest.wLength == sizeof(int32_t) && i < CHANNEL_COUNT)
+            {
+                int32_t target;
+                Endpoint_ClearSETUP();
+                if (Endpoint_Read_Control_Stream_LE(&target, sizeof(target)) != ENDPOINT_RWCSTREAM_NoError)
+                    break;
+
+                // Larger targets would overflow the internal step count
+                if (!valid_target(target))
+                {
+                    Endpoint_StallTransaction();
+                    break;
+                }
+
+                stepper_set_target(i, target);
+                Endpoint_ClearIN();
+            }
+
+            break;
+        case USB_VENDOR_REQUEST_SCHEDULE_TARGET:
+            if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_INTERFACE) &&
+                USB_ControlRequest.wLength == sizeof(usb_vendor_schedule) && i < CHANNEL_COUNT)
+            {
+                usb_vendor_schedule schedule;
+                Endpoint_ClearSETUP();
+                if (Endpoint_Read_Control_Stream_LE(&schedule, sizeof(schedule)) != ENDPOINT_RWCSTREAM_NoError)
+                    break;
+
+                if (!valid_target(schedule.target))
+                {
+                    Endpoint_StallTransaction();
+                    break;
+                }
+
+                stepper_schedule_target(i, schedule.target, schedule.time);
+                Endpoint_ClearIN();
+            }
+
+            break;
+        case USB_VENDOR_REQUEST_STOP:
+            if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_INTERFACE) &&
+                i < CHANNEL_COUNT)
+            {
+                Endpoint_ClearSETUP();
+                priority_stop(i, rx_tail);
+                Endpoint_ClearStatusStage();
+            }
+
+            break;
+    }
+}
+
 void EVENT_USB_Device_ControlRequest(void)
 {
+    if ((USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_TYPE) == REQTYPE_VENDOR &&
+        (USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_RECIPIENT) == REQREC_INTERFACE &&
+        USB_ControlRequest.wIndex == INTERFACE_ID_Vendor)
+    {
+        process_vendor_request();
+        return;
+    }
+
     CDC_Device_ProcessControlRequest(&interface);
 }
 
 void EVENT_USB_Device_StartOfFrame(void)
 {
     // SOF event runs once per millisecond when enabled
-    // Use this to count down and turn off the RX/TX LEDs.
+    // Use this to advance the device clock, receive commands, send queued
+    // data and the status report, and to count down and turn off the RX/TX LEDs.
+    clock_start_of_frame();
+    receive_endpoint();
+    flush_tx();
+    send_status_report();
+
     if (tx_led_pulse && !(--tx_led_pulse))
-        gpio_output_set_low(tx_led);
+        gpio_output_set_low_isr(tx_led);
     if (rx_led_pulse && !(--rx_led_pulse))
-        gpio_output_set_low(rx_led);
-
-    // Disable SOF event while both LEDs are disabled
-    if (!tx_led_pulse && !rx_led_pulse)
-        USB_Device_DisableSOFEvents();
+        gpio_output_set_low_isr(rx_led);
 }
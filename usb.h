@@ -3,14 +3,89 @@
 //**********************************************************************************
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifndef FOCUSER_USB_H
 #define FOCUSER_USB_H
 
+#include "stepper.h"
+
+// Control requests accepted by the vendor-specific interface.
+// These are addressed to the interface (wIndex = 2) and use wValue to select
+// a 0-indexed channel where required. Values are little-endian.
+// Targets are limited to the 7 digits accepted by the serial commands, and
+// requests with larger targets are stalled.
+#define USB_VENDOR_TARGET_LIMIT 9999999L
+
+enum usb_vendor_request
+{
+    // Device to host: returns usb_vendor_status (wValue unused)
+    USB_VENDOR_REQUEST_GET_STATUS = 0x01,
+
+    // Host to device: sets the channel target to the int32_t in the data stage
+    USB_VENDOR_REQUEST_SET_TARGET = 0x02,
+
+    // Host to device: stops the channel at its current position (no data stage)
+    USB_VENDOR_REQUEST_STOP = 0x03,
+
+    // Host to device: schedules a move using the usb_vendor_schedule in the data stage
+    USB_VENDOR_REQUEST_SCHEDULE_TARGET = 0x04,
+};
+
+typedef struct
+{
+    int32_t target;
+    uint32_t time;
+} __attribute__((packed)) usb_vendor_schedule;
+
+typedef struct
+{
+    int32_t target;
+    int32_t current;
+} __attribute__((packed)) usb_vendor_channel_status;
+
+// Times are device clock milliseconds
+typedef struct
+{
+    uint32_t time;
+    uint8_t channel_count;
+    usb_vendor_channel_status channels[CHANNEL_COUNT];
+} __attribute__((packed)) usb_vendor_status;
+
+// Number of temperature readings included in the status report
+// These are the first probe indices; the report must fit in a single STATUS_EPSIZE packet
+#define USB_STATUS_TEMPERATURE_COUNT 4
+
+// Temperature value used in the status report for probes without a reading
+#define USB_STATUS_TEMPERATURE_UNKNOWN INT16_MIN
+
+// Status flags
+#define USB_STATUS_FLAG_FANS_ENABLED 0x80
+
+// Status report sent on the vendor interface interrupt IN endpoint every frame.
+// Time is the device clock (in milliseconds) when the report was generated.
+// Bit i of flags is set while channel i is moving.
+// Temperatures are raw DS18B20 readings (1/16 degree C) for probe indices 1-4.
+typedef struct
+{
+    uint32_t time;
+    uint8_t flags;
+    usb_vendor_channel_status channels[CHANNEL_COUNT];
+    int16_t temperatures[USB_STATUS_TEMPERATURE_COUNT];
+} __attribute__((packed)) usb_status_report;
+
 void usb_initialize(gpin_t *usb_conn_led, gpin_t *usb_rx_led, gpin_t *usb_tx_led);
-bool usb_can_read(void);
-int16_t usb_read(void);
+int16_t usb_read_line(char **line);
+void usb_release_line(void);
+bool usb_line_stopped(uint8_t channel);
 void usb_write(uint8_t b);
 void usb_write_data(void *buf, uint16_t len);
+void usb_stream_begin(void);
+bool usb_stream_write(const void *buf, uint8_t len);
+void usb_stream_end(void);
+uint16_t usb_tx_overflows(void);
+uint16_t usb_frame_number(void);
+void usb_status_set_fans(bool enabled);
+void usb_status_set_temperature(uint8_t i, int16_t reading);
 #endif
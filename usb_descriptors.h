@@ -55,7 +55,13 @@
 		#define CDC_NOTIFICATION_EPSIZE        8
 
 		/** Size in bytes of the CDC data IN and OUT endpoints. */
-		#define CDC_TXRX_EPSIZE                16
+		#define CDC_TXRX_EPSIZE                64
+
+		/** Endpoint address of the vendor interface status report interrupt IN endpoint. */
+		#define STATUS_EPADDR                  (ENDPOINT_DIR_IN  | 5)
+
+		/** Size in bytes of the vendor interface status report interrupt IN endpoint. */
+		#define STATUS_EPSIZE                  32
 
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
@@ -66,6 +72,9 @@
 		{
 			USB_Descriptor_Configuration_Header_t    Config;
 
+			// CDC Interface Association
+			USB_Descriptor_Interface_Association_t   CDC_IAD;
+
 			// CDC Command Interface
 			USB_Descriptor_Interface_t               CDC_CCI_Interface;
 			USB_CDC_Descriptor_FunctionalHeader_t    CDC_Functional_Header;
@@ -77,6 +86,10 @@
 			USB_Descriptor_Interface_t               CDC_DCI_Interface;
 			USB_Descriptor_Endpoint_t                CDC_DataOutEndpoint;
 			USB_Descriptor_Endpoint_t                CDC_DataInEndpoint;
+
+			// Vendor Control Interface
+			USB_Descriptor_Interface_t               Vendor_Interface;
+			USB_Descriptor_Endpoint_t                Vendor_StatusEndpoint;
 		} USB_Descriptor_Configuration_t;
 
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -87,6 +100,7 @@
 		{
 			INTERFACE_ID_CDC_CCI = 0, /**< CDC CCI interface descriptor ID */
 			INTERFACE_ID_CDC_DCI = 1, /**< CDC DCI interface descriptor ID */
+			INTERFACE_ID_Vendor  = 2, /**< Vendor control interface descriptor ID */
 		};
 
 		/** Enum for the device string descriptor IDs within the device. Each string descriptor should